@@ -0,0 +1,375 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <strutils.hpp>
+#include <utils.hpp>
+#include <myerror.hpp>
+#include "mcstream.hpp"
+
+struct Args {
+  Args() : num_reps(3),tools_dir(),work_dir("/tmp"),csv(false),corpus() {}
+
+  size_t num_reps;
+  std::string tools_dir,work_dir;
+  bool csv;
+  std::vector<std::string> corpus;
+} args;
+std::string myerror="";
+std::string mywarning="";
+
+// the part of a corpus file that a tool reads: the whole dataset, its first
+// file, or its first file up to the first empty record - the cosconvert modes
+// that remove COS-blocking, except -X, stop at the end of the first file, and
+// -b, -r, -v and -6 stop at an empty record
+enum {WHOLE_DATASET=0,FIRST_FILE,FIRST_DATA,NUM_EXTENTS};
+
+// a Benchmark runs one tool in one mode - in "command", "%in" is the input
+// file, "%out" the output file and "%dir" the work directory; "extent" is the
+// part of the corpus file that is read, "input" names the output of an earlier
+// benchmark, for the modes that put COS-blocking back (these read all of it),
+// and "keep" saves the output of this one under that name
+struct Benchmark {
+  Benchmark(std::string name,std::string command,int extent = WHOLE_DATASET,std::string input = "",std::string keep = "") : name(name),command(command),extent(extent),input(input),keep(keep) {}
+
+  std::string name,command;
+  int extent;
+  std::string input,keep;
+};
+const std::vector<Benchmark> BENCHMARKS{
+  Benchmark("cosfile","cosfile %in"),
+  Benchmark("cosfile --structure-only","cosfile --structure-only %in"),
+  Benchmark("cossplit","cossplit -p %dir/split %in"),
+  Benchmark("cossplit -b","cossplit -b -p %dir/split %in"),
+  Benchmark("cosconvert -b","cosconvert -b %in %out",FIRST_DATA,"","bin"),
+  Benchmark("cosconvert -c","cosconvert -c %in %out",FIRST_FILE,"","txt"),
+  Benchmark("cosconvert -f big","cosconvert -f big %in %out",FIRST_FILE,"","f77"),
+  Benchmark("cosconvert -r","cosconvert -r %in %out",FIRST_DATA),
+  Benchmark("cosconvert -v","cosconvert -v %in %out",FIRST_DATA),
+  Benchmark("cosconvert -6","cosconvert -6 %in %out",FIRST_DATA),
+  Benchmark("cosconvert -X f77","cosconvert -X f77 %in %out"),
+  Benchmark("cosconvert -B","cosconvert -B %out %in",WHOLE_DATASET,"bin"),
+  Benchmark("cosconvert -C","cosconvert -C %out %in",WHOLE_DATASET,"txt"),
+  Benchmark("cosconvert -F","cosconvert -F %out %in",WHOLE_DATASET,"f77"),
+  Benchmark("cosconvert -X cos","cosconvert --from f77 -X cos %in %out",WHOLE_DATASET,"f77"),
+};
+
+// the number of bytes and records in each extent of a corpus file
+struct CorpusExtents {
+  CorpusExtents() : bytes(),records() {}
+
+  size_t bytes[NUM_EXTENTS],records[NUM_EXTENTS];
+};
+
+// a Result holds the best time of the repetitions of a run, and the peak RSS
+// of any of them
+struct Result {
+  Result() : seconds(0.),input_bytes(0),num_records(0),peak_rss_kb(0),failed(false) {}
+
+  double seconds;
+  size_t input_bytes,num_records;
+  long peak_rss_kb;
+  bool failed;
+};
+
+void parse_args(int argc,char **argv)
+{
+  auto unix_args=unixutils::unix_args_string(argc,argv,'!');
+  auto sp=strutils::split(unix_args,"!");
+  size_t n=0;
+  for (; n < sp.size() && sp[n][0] == '-'; ++n) {
+    if (sp[n] == "-r") {
+	if (n+1 == sp.size() || !strutils::is_numeric(sp[n+1]) || sp[n+1].length() > 9) {
+	  std::cerr << "Error: -r requires a number of repetitions" << std::endl;
+	  exit(1);
+	}
+	args.num_reps=std::stoi(sp[++n]);
+	if (args.num_reps == 0) {
+	  args.num_reps=1;
+	}
+    }
+    else if (sp[n] == "-t" && n+1 < sp.size()) {
+	args.tools_dir=sp[++n];
+    }
+    else if (sp[n] == "-d" && n+1 < sp.size()) {
+	args.work_dir=sp[++n];
+    }
+    else if (sp[n] == "--csv") {
+	args.csv=true;
+    }
+    else {
+	std::cerr << "Error: invalid option " << sp[n] << std::endl;
+	exit(1);
+    }
+  }
+  for (; n < sp.size(); ++n) {
+    args.corpus.emplace_back(sp[n]);
+  }
+  if (args.corpus.size() == 0) {
+    std::cerr << "Error: no corpus files given" << std::endl;
+    exit(1);
+  }
+// the tools are looked for next to cosbench, unless a directory is given
+  if (args.tools_dir.length() == 0) {
+    std::string path=argv[0];
+    auto idx=path.rfind("/");
+    args.tools_dir=(idx == std::string::npos) ? "." : path.substr(0,idx);
+  }
+}
+
+size_t file_size(std::string filename)
+{
+  struct stat buf;
+  return (stat(filename.c_str(),&buf) == 0) ? buf.st_size : 0;
+}
+
+// measure_corpus() walks the records of a corpus file and notes where each
+// extent ends - an extent that is not ended early runs to the end of the one
+// that contains it
+CorpusExtents measure_corpus(std::string filename)
+{
+  CorpusExtents extents;
+  imcstream istream;
+  if (!istream.open(filename)) {
+    return extents;
+  }
+  auto in_first_file=true,found_empty=false;
+  size_t num_records=0;
+  long long status;
+  while ( (status=istream.ignore()) != craystream::eod && status != bfstream::error) {
+    if (status == bfstream::eof) {
+	if (in_first_file) {
+	  extents.bytes[FIRST_FILE]=istream.tell()+cosblock::word_size;
+	  extents.records[FIRST_FILE]=num_records;
+	  in_first_file=false;
+	}
+	continue;
+    }
+    if (status == 0 && in_first_file && !found_empty) {
+	extents.bytes[FIRST_DATA]=istream.tell()+cosblock::word_size;
+	extents.records[FIRST_DATA]=num_records;
+	found_empty=true;
+    }
+    ++num_records;
+  }
+  extents.bytes[WHOLE_DATASET]=file_size(filename);
+  extents.records[WHOLE_DATASET]=num_records;
+  if (in_first_file) {
+    extents.bytes[FIRST_FILE]=extents.bytes[WHOLE_DATASET];
+    extents.records[FIRST_FILE]=num_records;
+  }
+  if (!found_empty) {
+    extents.bytes[FIRST_DATA]=extents.bytes[FIRST_FILE];
+    extents.records[FIRST_DATA]=extents.records[FIRST_FILE];
+  }
+  return extents;
+}
+
+// clear_directory() removes what a run left in the work directory - the saved
+// outputs, whose names start with "keep.", are removed only with "saved"
+void clear_directory(std::string dir,bool saved = false)
+{
+  auto dp=opendir(dir.c_str());
+  if (dp == nullptr) {
+    return;
+  }
+  struct dirent *entry;
+  while ( (entry=readdir(dp)) != nullptr) {
+    std::string name=entry->d_name;
+    if (name != "." && name != ".." && (saved || name.substr(0,5) != "keep.")) {
+	unlink((dir+"/"+name).c_str());
+    }
+  }
+  closedir(dp);
+}
+
+// run() forks and execs a command, with its output going back through a pipe,
+// and returns the wall-clock time, the peak RSS from wait4() and whether it
+// exited with status 0
+bool run(const std::vector<std::string>& command,std::string& output,double& seconds,long& peak_rss_kb)
+{
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  struct timespec start,end;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  auto pid=fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    dup2(fds[1],STDOUT_FILENO);
+    auto null_fd=open("/dev/null",O_WRONLY);
+    if (null_fd >= 0) {
+	dup2(null_fd,STDERR_FILENO);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    std::vector<char *> argv;
+    for (const auto& arg : command) {
+	argv.emplace_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.emplace_back(nullptr);
+    execv(argv[0],argv.data());
+    _exit(127);
+  }
+  close(fds[1]);
+  output="";
+  char buf[4096];
+  ssize_t n;
+  while ( (n=read(fds[0],buf,sizeof(buf))) != 0) {
+    if (n < 0) {
+	if (errno == EINTR) {
+	  continue;
+	}
+	break;
+    }
+    output.append(buf,n);
+  }
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  while (wait4(pid,&status,0,&usage) < 0) {
+    if (errno != EINTR) {
+	return false;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  seconds=(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1.e9;
+  peak_rss_kb=usage.ru_maxrss;
+  return (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// records_read() takes the number of records from the "... read: N" line that
+// cosconvert prints
+size_t records_read(std::string output)
+{
+  auto idx=output.find(" read: ");
+  if (idx == std::string::npos) {
+    return 0;
+  }
+  return std::stoll(output.substr(idx+7));
+}
+
+Result run_benchmark(const Benchmark& benchmark,std::string corpus_file,const CorpusExtents& extents,std::string dir)
+{
+  Result result;
+  std::string input;
+  if (benchmark.input.length() > 0) {
+    input=dir+"/keep."+benchmark.input;
+    result.input_bytes=file_size(input);
+  }
+  else {
+    input=corpus_file;
+    result.input_bytes=extents.bytes[benchmark.extent];
+  }
+  auto out=dir+"/out";
+  std::vector<std::string> command;
+  for (auto arg : strutils::split(benchmark.command)) {
+    strutils::replace_all(arg,"%in",input);
+    strutils::replace_all(arg,"%out",out);
+    strutils::replace_all(arg,"%dir",dir);
+    command.emplace_back(arg);
+  }
+  command.front()=args.tools_dir+"/"+command.front();
+  for (size_t n=0; n < args.num_reps; ++n) {
+    std::string output;
+    double seconds;
+    long peak_rss_kb;
+    if (!run(command,output,seconds,peak_rss_kb)) {
+	result.failed=true;
+    }
+    if (n == 0 || seconds < result.seconds) {
+	result.seconds=seconds;
+    }
+    result.peak_rss_kb=std::max(result.peak_rss_kb,peak_rss_kb);
+    result.num_records=records_read(output);
+    if (n == args.num_reps-1 && !result.failed && benchmark.keep.length() > 0) {
+	rename(out.c_str(),(dir+"/keep."+benchmark.keep).c_str());
+    }
+    clear_directory(dir);
+  }
+  return result;
+}
+
+void print_result(std::string corpus_file,const Benchmark& benchmark,Result& result,const CorpusExtents& extents)
+{
+// the tools that do not report a count read every record of their extent
+  if (result.num_records == 0 && benchmark.input.length() == 0) {
+    result.num_records=extents.records[benchmark.extent];
+  }
+  auto mb=result.input_bytes/1048576.;
+  auto mb_per_s=(result.seconds > 0.) ? mb/result.seconds : 0.;
+  auto records_per_s=(result.seconds > 0.) ? result.num_records/result.seconds : 0.;
+  if (args.csv) {
+    std::cout << corpus_file << "," << benchmark.name << "," << std::fixed << std::setprecision(3) << mb << "," << result.seconds << "," << mb_per_s << "," << std::setprecision(0) << records_per_s << "," << result.peak_rss_kb << "," << ((result.failed) ? "failed" : "ok") << std::endl;
+    return;
+  }
+  std::cout << "  " << std::left << std::setw(26) << benchmark.name << std::right << std::fixed << std::setprecision(1) << std::setw(10) << mb << std::setprecision(3) << std::setw(10) << result.seconds << std::setprecision(1) << std::setw(10) << mb_per_s << std::setprecision(0) << std::setw(12) << records_per_s << std::setprecision(1) << std::setw(10) << result.peak_rss_kb/1024.;
+  if (result.failed) {
+    std::cout << "  failed";
+  }
+  std::cout << std::endl;
+}
+
+int main(int argc,char **argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " [-r num] [-t dir] [-d dir] [--csv] files" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "function:  " << argv[0] << " runs cosfile, cossplit and each conversion mode of" << std::endl;
+    std::cerr << "           cosconvert over a corpus of COS-blocked files (see cosgen), and" << std::endl;
+    std::cerr << "           reports MB/s and records/s from the best of the runs, and the peak" << std::endl;
+    std::cerr << "           resident set size - MB and records are those of the part of the" << std::endl;
+    std::cerr << "           file that a mode reads: the cosconvert modes that remove COS-" << std::endl;
+    std::cerr << "           blocking (except -X) read only the first file, and -b, -r, -v" << std::endl;
+    std::cerr << "           and -6 stop at its first empty record" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "options:" << std::endl;
+    std::cerr << "  -r num   runs each benchmark \"num\" times (default 3)" << std::endl;
+    std::cerr << "  -t dir   the directory of the tools (default: the directory of " << argv[0] << ")" << std::endl;
+    std::cerr << "  -d dir   makes the work directory for the outputs in \"dir\" (default /tmp)" << std::endl;
+    std::cerr << "  --csv    writes one line for each benchmark as comma-separated values:" << std::endl;
+    std::cerr << "           file,benchmark,MB,seconds,MB/s,records/s,peak RSS (KB),status" << std::endl;
+    exit(1);
+  }
+  parse_args(argc,argv);
+  auto name=args.work_dir+"/cosbench.XXXXXX";
+  std::vector<char> tmpl(name.begin(),name.end());
+  tmpl.emplace_back('\0');
+  if (mkdtemp(tmpl.data()) == nullptr) {
+    std::cerr << "Error creating a work directory in " << args.work_dir << std::endl;
+    exit(1);
+  }
+  std::string dir=tmpl.data();
+  if (args.csv) {
+    std::cout << "file,benchmark,MB,seconds,MB/s,records/s,peak_rss_kb,status" << std::endl;
+  }
+  for (const auto& file : args.corpus) {
+    auto extents=measure_corpus(file);
+    if (!args.csv) {
+	std::cout << "\n" << file << ": " << extents.bytes[WHOLE_DATASET] << " bytes, " << extents.records[WHOLE_DATASET] << " records (first file: " << extents.bytes[FIRST_FILE] << " bytes, " << extents.records[FIRST_FILE] << " records)" << std::endl;
+	std::cout << "  " << std::left << std::setw(26) << "Benchmark" << std::right << std::setw(10) << "MB" << std::setw(10) << "Seconds" << std::setw(10) << "MB/s" << std::setw(12) << "Records/s" << std::setw(10) << "RSS MB" << std::endl;
+    }
+    for (const auto& benchmark : BENCHMARKS) {
+	auto result=run_benchmark(benchmark,file,extents,dir);
+	print_result(file,benchmark,result,extents);
+    }
+// the saved outputs belong to this corpus file
+    clear_directory(dir,true);
+  }
+  rmdir(dir.c_str());
+}
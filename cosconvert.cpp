@@ -1,33 +1,153 @@
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include <bfstream.hpp>
 #include <grid.hpp>
 #include <strutils.hpp>
 #include <utils.hpp>
 #include <bits.hpp>
-#include <tempfile.hpp>
 #include <myerror.hpp>
+#include "mcstream.hpp"
+
+const size_t MAX_NUM_JOBS=64;
 
 struct ArgList {
-  ArgList() : recln(0),conv(' '),big_endian(),cosfile(),non_cosfile() {}
+  ArgList() : recln(0),conv(' '),big_endian(),sync(false),in_place(false),batch(false),no_cache(false),char_bits(6),num_jobs(1),marker_size(4),cosfile(),non_cosfile(),manifest(),compress(),from(),to(),check(),files() {}
 
   int recln;
   char conv;
-  bool big_endian;
-  std::string cosfile,non_cosfile;
+  bool big_endian,sync,in_place,batch,no_cache;
+  int char_bits;
+  size_t num_jobs,marker_size;
+  std::string cosfile,non_cosfile,manifest,compress,from,to,check;
+  std::vector<std::string> files;
 } args;
 
+// a ConvertJob holds the files of one conversion and what came of it - a
+// conversion that fails sets "error" and returns instead of exiting, so that
+// the rest of a batch can go on
+struct ConvertJob {
+  ConvertJob(std::string cos,std::string non_cos) : cosfile(cos),non_cosfile(non_cos),temp_file(),sink(),read_units(),written_units(),error(),num_read(0),num_written(0),num_bad(0) {}
+
+  std::string cosfile,non_cosfile,temp_file,sink;
+  std::string read_units,written_units,error;
+  size_t num_read,num_written,num_bad;
+};
+struct JobQueue {
+  JobQueue() : jobs(),next(0),lock(PTHREAD_MUTEX_INITIALIZER) {}
+
+  std::vector<ConvertJob> jobs;
+  size_t next;
+  pthread_mutex_t lock;
+};
+
 std::string myerror="";
 std::string mywarning="";
 
+// the formats that -X converts between
+const std::string RECORD_FORMATS="binary cos cosvbs f77 grib rptout text vbs vbsblock";
+
+bool is_record_format(std::string format)
+{
+  auto formats=strutils::split(RECORD_FORMATS);
+  return std::find(formats.begin(),formats.end(),format) != formats.end();
+}
+
+// -X, like the flags that remove COS-blocking, reads the first file and writes
+// the second
+bool removes_cos_blocking(char conv)
+{
+  return std::string("6bcfrvX").find(conv) != std::string::npos;
+}
+
 void parse_args(int argc,char **argv)
 {
   auto next=1;
-  if (argv[1][0] == '-') {
+  while (next < argc && (std::string(argv[next]).substr(0,2) == "--" || std::string(argv[next]) == "-j")) {
+    if (std::string(argv[next]) == "--sync") {
+	args.sync=true;
+    }
+    else if (std::string(argv[next]) == "--in-place") {
+	args.in_place=true;
+    }
+    else if (std::string(argv[next]) == "--no-cache") {
+	args.no_cache=true;
+    }
+    else if (std::string(argv[next]) == "--marker-size" && next+1 < argc && strutils::is_numeric(argv[next+1]) && std::string(argv[next+1]).length() < 3) {
+	args.marker_size=std::stoi(argv[++next]);
+	if (args.marker_size != 4 && args.marker_size != 8) {
+	  std::cerr << "Error: the F77 record marker size must be 4 or 8" << std::endl;
+	  exit(1);
+	}
+    }
+    else if (std::string(argv[next]) == "--compress" && next+1 < argc) {
+	args.compress=argv[++next];
+#ifdef HAVE_ZSTD
+	if (args.compress != "gzip" && args.compress != "zstd") {
+#else
+	if (args.compress != "gzip") {
+#endif
+	  std::cerr << "Error: compression format " << args.compress << " not supported" << std::endl;
+	  exit(1);
+	}
+    }
+    else if (std::string(argv[next]) == "--check" && next+1 < argc) {
+	args.check=argv[++next];
+    }
+    else if (std::string(argv[next]) == "--from" && next+1 < argc) {
+	args.from=argv[++next];
+    }
+    else if (std::string(argv[next]) == "--manifest" && next+1 < argc) {
+	args.manifest=argv[++next];
+	args.batch=true;
+    }
+    else if (std::string(argv[next]) == "-j" && next+1 < argc && strutils::is_numeric(argv[next+1])) {
+	args.num_jobs=std::stoi(argv[++next]);
+	if (args.num_jobs == 0) {
+	  args.num_jobs=1;
+	}
+	else if (args.num_jobs > MAX_NUM_JOBS) {
+	  args.num_jobs=MAX_NUM_JOBS;
+	}
+	args.batch=true;
+    }
+    else {
+	std::cerr << "Error: invalid option " << argv[next] << std::endl;
+	exit(1);
+    }
+    ++next;
+  }
+  if (next < argc && argv[next][0] == '-') {
     args.conv=argv[next][1];
-    if ((args.conv == 'B' || args.conv == 'b') && strutils::is_numeric(argv[next+1])) {
+    if ((args.conv == 'B' || args.conv == 'b') && next+1 < argc && strutils::is_numeric(argv[next+1])) {
 	args.recln=atoi(argv[++next]);
     }
-    else if (args.conv == 'f') {
+    else if (args.conv == '6' && next+1 < argc && (std::string(argv[next+1]) == "6" || std::string(argv[next+1]) == "8")) {
+	args.char_bits=atoi(argv[++next]);
+    }
+    else if (args.conv == 'X' && next+1 < argc) {
+	args.to=argv[++next];
+// F77 records are written big-endian, as with -f big
+	args.big_endian=true;
+    }
+    else if (args.conv == 'f' && next+1 < argc) {
 	++next;
 	if (std::string(argv[next]) == "big") {
 	  args.big_endian=true;
@@ -49,553 +169,2621 @@ void parse_args(int argc,char **argv)
     std::cerr << "Error: no convert flag specified" << std::endl;
     exit(1);
   }
-  if (next >= argc) {
-    std::cerr << "Error: no COS-blocked filename given" << std::endl;
+  if (std::string("6bBcCfFGrRvX").find(args.conv) == std::string::npos) {
+    std::cerr << "Error: conversion flag -" << args.conv << " not supported" << std::endl;
     exit(1);
   }
-  args.cosfile=argv[next++];
-  if (next < argc)
-    args.non_cosfile=argv[next];
-}
-
-void cos_to_6_bit()
-{
-  icstream istream;
-  if (!istream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
+  if (args.conv == 'X' && !is_record_format(args.to)) {
+    std::cerr << "Error: -X needs one of the formats: " << RECORD_FORMATS << std::endl;
     exit(1);
   }
-  TempFile *tfile=nullptr;
-  if (args.non_cosfile.length() == 0) {
-    tfile=new TempFile(".");
-    args.non_cosfile=tfile->name();
-  }
-  std::ofstream ofs(args.non_cosfile.c_str());
-  if (!ofs.is_open()) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
+  if (args.from.length() > 0 && (args.conv != 'X' || !is_record_format(args.from))) {
+    std::cerr << "Error: --from needs -X and one of the formats: " << RECORD_FORMATS << std::endl;
     exit(1);
   }
-  const int BUF_LEN=500000;
-  std::unique_ptr<unsigned char []> buffer(new unsigned char[BUF_LEN]);
-  std::unique_ptr<unsigned char []> buffer2(new unsigned char[BUF_LEN]);
-  int num_remain=0;
-  unsigned char buf_remain = 0x0;
-  int num_written=0;
-  int num_bytes;
-  while ( (num_bytes=istream.read(buffer.get(),BUF_LEN)) > 0) {
-    if (num_bytes == BUF_LEN) {
-	std::cerr << "Warning: buffer not large enough on record " << istream.number_read() << std::endl;
+  if (args.batch) {
+// in batch mode, the files on the command line are cosfiles, which are each
+// converted in place
+    if (next < argc && !removes_cos_blocking(args.conv)) {
+	std::cerr << "Error: adding COS-blocking to a batch of files needs a manifest" << std::endl;
+	exit(1);
     }
-    auto num6=num_bytes*8/6;
-    num6*=6;
-    auto num8=num_bytes*8;
-    if (num_remain == 0) {
-	if (num6 == num8) {
-	  ofs.write(reinterpret_cast<char *>(buffer.get()),num_bytes);
-	  num_remain=0;
-	}
-	else {
-	  ofs.write(reinterpret_cast<char *>(buffer.get()),num6/8);
-	  num_remain=num6 % 8;
-	  bits::get(buffer.get(),buf_remain,(num6/8)*8,num_remain);
-	}
+    for (; next < argc; ++next) {
+	args.files.emplace_back(argv[next]);
     }
-    else {
-	bits::set(buffer2.get(),buf_remain,0,num_remain);
-	bits::set(buffer2.get(),buffer.get(),num_remain,8,0,num_bytes);
-	num6+=num_remain;
-	if (num6 == num8) {
-	  ofs.write(reinterpret_cast<char *>(buffer2.get()),num_bytes);
-	  num_remain=0;
-	}
-	else {
-std::cerr << "Error: can't get past here" << std::endl;
-exit(1);
-	}
+    if (args.files.size() == 0 && args.manifest.length() == 0) {
+	std::cerr << "Error: no COS-blocked filenames given" << std::endl;
+	exit(1);
     }
-    ++num_written;
   }
-  if (num_remain > 0) {
-    bits::set(buffer2.get(),buf_remain,0,num_remain);
-    bits::set(buffer2.get(),0,num_remain,8-num_remain);
-    ofs.write(reinterpret_cast<char *>(buffer2.get()),1);
-  }
-  ofs.close();
-  if (tfile != nullptr) {
-    if (system(("mv "+tfile->name()+" "+args.cosfile).c_str()) != 0) {
-      std::cerr << "Error while removing COS-blocking" << std::endl;
-      exit(1);
+  else {
+    if (next >= argc) {
+	std::cerr << "Error: no COS-blocked filename given" << std::endl;
+	exit(1);
+    }
+    args.cosfile=argv[next++];
+    if (next < argc)
+	args.non_cosfile=argv[next];
+// COS-blocking that is removed from standard input goes to standard output
+    if (args.cosfile == "-" && args.non_cosfile.length() == 0 && removes_cos_blocking(args.conv)) {
+	args.non_cosfile="-";
     }
   }
-  std::cout << "\n  COS-blocked records read: " << istream.number_read() << std::endl;
-  std::cout << "  Binary records written: " << num_written << std::endl;
-}
-
-void cos_to_binary()
-{
-  icstream istream;
-  if (!istream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << " for input" << std::endl;
+  if (args.in_place && (args.conv != 'b' || args.recln > 0 || args.non_cosfile.length() > 0 || args.cosfile == "-")) {
+    std::cerr << "Error: --in-place only applies to -b without a record length or a non-cosfile" << std::endl;
     exit(1);
   }
-  TempFile *tfile=nullptr;
-  if (args.non_cosfile.length() == 0) {
-    tfile=new TempFile(".");
-    args.non_cosfile=tfile->name();
+  if (args.check.length() > 0 && args.conv != 'r' && args.conv != 'R') {
+    std::cerr << "Error: --check only applies to -r and -R" << std::endl;
+    exit(1);
   }
-  std::ofstream ofs(args.non_cosfile.c_str());
-  if (!ofs.is_open()) {
-    std::cerr << "Error opening " << args.non_cosfile << " for output" << std::endl;
+  if (args.in_place && args.compress.length() > 0) {
+    std::cerr << "Error: --in-place can not be used with --compress" << std::endl;
     exit(1);
   }
-  std::unique_ptr<unsigned char []> blank(new unsigned char[args.recln]);
-  for (int n=0; n < args.recln; ++n) {
-    blank[n]=0;
+}
+
+// a manifest lists one conversion per line: a cosfile, followed by a
+// non-cosfile when COS-blocking is being added (or when the converted data
+// are not to replace the cosfile) - blank lines and lines that start with '#'
+// are skipped
+void read_manifest(std::vector<ConvertJob>& jobs)
+{
+  std::ifstream ifs(args.manifest.c_str());
+  if (!ifs.is_open()) {
+    std::cerr << "Error opening manifest " << args.manifest << std::endl;
+    exit(1);
   }
-  int BUF_LEN = 0;
-  std::unique_ptr<unsigned char []> buffer;
-  int num_bytes;
-  size_t num_written=0;
-  while ( (num_bytes = istream.peek()) > 0) {
-    if (num_bytes > BUF_LEN) {
-      BUF_LEN = num_bytes;
-      buffer.reset(new unsigned char[BUF_LEN]);
+  std::string line;
+  size_t line_num=0;
+  while (std::getline(ifs,line)) {
+    ++line_num;
+    strutils::trim(line);
+    if (line.length() == 0 || line[0] == '#') {
+	continue;
     }
-    num_bytes = istream.read(buffer.get(), BUF_LEN);
-    if (args.recln == 0) {
-	ofs.write(reinterpret_cast<char *>(buffer.get()),num_bytes);
-    }
-    else {
-	if (args.recln > num_bytes) {
-	  ofs.write(reinterpret_cast<char *>(buffer.get()),num_bytes);
-	  auto fill=args.recln-num_bytes;
-	  ofs.write(reinterpret_cast<char *>(blank.get()),fill);
-	}
-	else {
-	  ofs.write(reinterpret_cast<char *>(buffer.get()),args.recln);
-	}
+    std::istringstream iss(line);
+    std::string cosfile,non_cosfile;
+    iss >> cosfile >> non_cosfile;
+    if (non_cosfile.length() == 0 && !removes_cos_blocking(args.conv)) {
+	std::cerr << "Error: no non-cosfile on line " << line_num << " of manifest " << args.manifest << std::endl;
+	exit(1);
     }
-    ++num_written;
-  }
-  if (tfile != nullptr) {
-    if (system(("mv "+tfile->name()+" "+args.cosfile).c_str()) != 0) {
-      std::cerr << "Error while removing COS-blocking" << std::endl;
-      exit(1);
+    if (args.in_place && non_cosfile.length() > 0) {
+	std::cerr << "Error: --in-place does not apply to a non-cosfile on line " << line_num << " of manifest " << args.manifest << std::endl;
+	exit(1);
     }
+    jobs.emplace_back(cosfile,non_cosfile);
   }
-  std::cout << "\n  COS-blocked records read: " << istream.number_read() << std::endl;
-  std::cout << "  Binary records written: " << num_written << std::endl;
 }
 
-void binary_to_cos()
+// "-" stands for standard input or output in place of a non-cosfile - the COS
+// streams take "-" themselves; the output goes to "sink" instead while it is
+// being compressed
+std::string input_path(const ConvertJob& job)
 {
-  FILE *fp;
-  if ( (fp=fopen(args.non_cosfile.c_str(),"r")) == NULL) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
-    exit(1);
+  return (job.non_cosfile == "-") ? "/dev/stdin" : job.non_cosfile;
+}
+
+std::string output_path(const ConvertJob& job)
+{
+  if (job.sink.length() > 0) {
+    return job.sink;
   }
-  ocstream ostream;
-  if (!ostream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
-    exit(1);
+  if (!removes_cos_blocking(args.conv)) {
+    return job.cosfile;
   }
-  std::unique_ptr<unsigned char []> buffer(new unsigned char[args.recln]);
-  size_t len;
-  size_t num_read=0,num_written=0;
-  while ( (len=fread(buffer.get(),1,args.recln,fp)) > 0) {
-    ++num_read;
-    ostream.write(buffer.get(),len);
-    ++num_written;
+  return (job.non_cosfile == "-") ? "/dev/stdout" : job.non_cosfile;
+}
+
+void remove_temp_file(ConvertJob& job)
+{
+  if (job.temp_file.length() > 0) {
+    unlink(job.temp_file.c_str());
+    job.temp_file="";
   }
-  ostream.close();
-  std::cout << "\n  Binary records read: " << num_read << std::endl;
-  std::cout << "  COS-blocked records written: " << num_written << std::endl;
 }
 
-void cos_to_unix()
+bool failed(ConvertJob& job,std::string error)
 {
-  icstream istream;
-  if (!istream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
-    exit(1);
+  job.error=error;
+  remove_temp_file(job);
+  return false;
+}
+
+// when no non-cosfile is given, the converted data are written to a temporary
+// file in the same directory as the COS-blocked file, and replace_cosfile()
+// then puts it in place of the COS-blocked file with one rename()
+std::string cosfile_directory(const ConvertJob& job)
+{
+  auto idx=job.cosfile.rfind("/");
+  if (idx == std::string::npos) {
+    return "";
   }
-  TempFile *tfile=nullptr;
-  if (args.non_cosfile.length() == 0) {
-    tfile=new TempFile(".");
-    args.non_cosfile=tfile->name();
+  return job.cosfile.substr(0,idx+1);
+}
+
+bool make_temp_file(ConvertJob& job)
+{
+  auto name=cosfile_directory(job)+".cosconvert.XXXXXX";
+  std::vector<char> tmpl(name.begin(),name.end());
+  tmpl.emplace_back('\0');
+  auto fd=mkstemp(tmpl.data());
+  if (fd < 0) {
+    return failed(job,"Error creating a temporary file in the directory of "+job.cosfile);
   }
-  FILE *fp;
-  if ( (fp=fopen(args.non_cosfile.c_str(),"w")) == NULL) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
-    exit(1);
+// the converted file keeps the permissions of the file that it replaces
+  struct stat buf;
+  if (stat(job.cosfile.c_str(),&buf) == 0) {
+    fchmod(fd,buf.st_mode & 07777);
   }
-  const int BUF_LEN=500000;
-  std::unique_ptr<unsigned char []> buffer(new unsigned char[BUF_LEN]);
-  int num_bytes;
-  size_t num_written=0;
-  while ( (num_bytes=istream.read(buffer.get(),BUF_LEN)) >= 0) {
-    if (num_bytes+1 == BUF_LEN)
-	std::cerr << "Warning: buffer not large enough on record " << istream.number_read() << std::endl;
-
-    buffer[num_bytes]=0xa;
-    fwrite(buffer.get(),1,num_bytes+1,fp);
+  close(fd);
+  job.temp_file=tmpl.data();
+  job.non_cosfile=job.temp_file;
+  return true;
+}
 
-    ++num_written;
-  }
-  fclose(fp);
-  if (tfile != nullptr) {
-    if (system(("mv "+tfile->name()+" "+args.cosfile).c_str()) != 0) {
-      std::cerr << "Error while removing COS-blocking" << std::endl;
-      exit(1);
-    }
+// with --sync, the converted data and then the directory entry that the
+// rename() changes are flushed to disk
+bool sync_file(std::string filename,int flags = O_RDONLY)
+{
+  auto fd=open(filename.c_str(),flags);
+  if (fd < 0) {
+    return false;
   }
-  std::cout << "\n  COS-blocked records read: " << istream.number_read() << std::endl;
-  std::cout << "  Unix records written: " << num_written << std::endl;
+  auto synced=(fsync(fd) == 0);
+  close(fd);
+  return synced;
 }
 
-void unix_to_cos()
+bool replace_cosfile(ConvertJob& job)
 {
-  std::ifstream ifs;
-  ifs.open(args.non_cosfile.c_str());
-  if (!ifs.is_open()) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
-    exit(1);
+  if (args.sync && !sync_file(job.temp_file)) {
+    return failed(job,"Error syncing "+job.temp_file);
   }
-  ocstream ostream;
-  if (!ostream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
-    exit(1);
+  if (rename(job.temp_file.c_str(),job.cosfile.c_str()) != 0) {
+    return failed(job,"Error while removing COS-blocking");
   }
-  const size_t BUF_LEN=32768;
-  std::unique_ptr<char []> buffer(new char[BUF_LEN]);
-  size_t num_read=0,num_written=0;
-  ifs.getline(buffer.get(),BUF_LEN);
-  while (!ifs.eof()) {
-    ++num_read;
-    ostream.write(reinterpret_cast<unsigned char *>(buffer.get()),ifs.gcount()-1);
-    ++num_written;
-    ifs.getline(buffer.get(),BUF_LEN);
+  job.temp_file="";
+  if (args.sync) {
+    auto dir=cosfile_directory(job);
+    if (!sync_file((dir.length() > 0) ? dir : ".",O_RDONLY | O_DIRECTORY)) {
+	return failed(job,"Error syncing the directory of "+job.cosfile);
+    }
   }
-  ostream.close();
-  std::cout << "\n  UNIX records read: " << num_read << std::endl;
-  std::cout << "  COS-blocked records written: " << num_written << std::endl;
+  return true;
 }
 
-void cos_to_f77()
+// COS-blocked records are decoded by a reader thread into a ring of batches
+// that the writer drains - the reader moves only "head" and the writer moves
+// only "tail", so a batch changes hands without a lock. A side that finds the
+// ring full (or empty) spins for a moment and then sleeps until the other side
+// moves its index, so that a side that is waiting on I/O does not keep the
+// other one busy; the lock is taken only to go to sleep, and by the other side
+// only when it has to wake a sleeper.
+const size_t NUM_BATCHES=4;
+const size_t BATCH_BYTES=1048576;
+const size_t BATCH_RECORDS=4096;
+const size_t NUM_SPINS=64;
+
+// a record in a batch is a view into the mapping of the dataset, or, when it
+// was stitched together from more than one block or read from a stream, a copy
+// at "offset" in the arena of the batch
+struct BatchRecord {
+  BatchRecord(const unsigned char *data,size_t offset,size_t length) : data(data),offset(offset),length(length) {}
+
+  const unsigned char *data;
+  size_t offset,length;
+};
+
+struct RecordBatch {
+  RecordBatch() : arena(),records(),status(0) {}
+
+  std::vector<unsigned char> arena;
+  std::vector<BatchRecord> records;
+  int status;
+};
+
+struct BatchRing {
+  BatchRing(imcstream& stream) : istream(stream),batches(),head(0),tail(0),stop(false),reader_asleep(false),writer_asleep(false),lock(PTHREAD_MUTEX_INITIALIZER),not_full(PTHREAD_COND_INITIALIZER),not_empty(PTHREAD_COND_INITIALIZER) {}
+
+  imcstream& istream;
+  RecordBatch batches[NUM_BATCHES];
+  std::atomic<size_t> head,tail;
+  std::atomic<bool> stop,reader_asleep,writer_asleep;
+  pthread_mutex_t lock;
+  pthread_cond_t not_full,not_empty;
+};
+
+// wait_for() sets "asleep" before the last look at "ready", and wake_up() moves
+// the index before it looks at "asleep" - with a full fence on each side, a
+// side that goes to sleep either sees the move or is seen to be asleep
+void wait_for(BatchRing& ring,pthread_cond_t& cond,std::atomic<bool>& asleep,std::function<bool()> ready)
 {
-  auto sys_is_big_endian=unixutils::system_is_big_endian();
-  icstream istream;
-  if (!istream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
-    exit(1);
+  for (size_t n=0; n < NUM_SPINS; ++n) {
+    if (ready()) {
+	return;
+    }
+    sched_yield();
   }
-  TempFile *tfile=nullptr;
-  if (args.non_cosfile.length() == 0) {
-    tfile=new TempFile(".");
-    args.non_cosfile=tfile->name();
+  pthread_mutex_lock(&ring.lock);
+  asleep.store(true,std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  while (!ready()) {
+    pthread_cond_wait(&cond,&ring.lock);
   }
-  std::ofstream ostream(args.non_cosfile.c_str());
-  if (!ostream.is_open()) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
-    exit(1);
+  asleep.store(false,std::memory_order_relaxed);
+  pthread_mutex_unlock(&ring.lock);
+}
+
+// wake_up() is called after an index has moved, and takes the lock to signal
+// only a side that is asleep - the lock makes sure that the signal does not
+// come between its last look at the index and its wait
+void wake_up(BatchRing& ring,pthread_cond_t& cond,std::atomic<bool>& asleep)
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (asleep.load(std::memory_order_relaxed)) {
+    pthread_mutex_lock(&ring.lock);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&ring.lock);
   }
-  const int BUF_LEN=500000;
-  std::unique_ptr<unsigned char []> buffer(new unsigned char[BUF_LEN]);
-  size_t num_written=0;
-  int num_bytes;
-  char nbuf[4];
-  while ( (num_bytes=istream.read(buffer.get(),BUF_LEN)) != bfstream::eof) {
-    if (num_bytes == BUF_LEN) {
-	std::cerr << "Error: buffer not large enough" << std::endl;
-	exit(1);
-    }
-    if (sys_is_big_endian == args.big_endian) {
-	ostream.write(reinterpret_cast<char *>(&num_bytes),4);
-    }
-    else {
-	bits::set(nbuf,num_bytes,0,32);
-	ostream.write(nbuf,4);
-    }
-    ostream.write(reinterpret_cast<char *>(buffer.get()),num_bytes);
-    if (sys_is_big_endian == args.big_endian) {
-	ostream.write(reinterpret_cast<char *>(&num_bytes),4);
+}
+
+extern "C" void *t_read(void *ring)
+{
+  BatchRing *r=reinterpret_cast<BatchRing *>(ring);
+  auto map=r->istream.mapped_data();
+  auto map_end=map+r->istream.mapped_length();
+  auto mapped=r->istream.is_mapped();
+  long long status=0;
+  while (status >= 0) {
+    auto head=r->head.load(std::memory_order_relaxed);
+    wait_for(*r,r->not_full,r->reader_asleep,
+    [&]() -> bool
+    {
+	return (head-r->tail.load(std::memory_order_acquire) < NUM_BATCHES || r->stop.load(std::memory_order_acquire));
+    });
+    if (r->stop.load(std::memory_order_acquire)) {
+	return nullptr;
     }
-    else {
-	bits::set(nbuf,num_bytes,0,32);
-	ostream.write(nbuf,4);
+    auto& batch=r->batches[head % NUM_BATCHES];
+    batch.arena.clear();
+    batch.records.clear();
+    batch.status=0;
+    while (batch.arena.size() < BATCH_BYTES && batch.records.size() < BATCH_RECORDS) {
+	const unsigned char *data;
+	status=r->istream.read(data);
+	if (status < 0) {
+// the end of the file (or an error) travels with the batch that it ends
+	  batch.status=status;
+	  break;
+	}
+// a view into the mapping stays valid - any other view is gone after the next
+// read
+	if (mapped && data >= map && data < map_end) {
+	  batch.records.emplace_back(data,0,status);
+	}
+	else {
+	  batch.records.emplace_back(nullptr,batch.arena.size(),status);
+	  batch.arena.insert(batch.arena.end(),data,data+status);
+	}
     }
-    ++num_written;
+    r->head.store(head+1,std::memory_order_release);
+    wake_up(*r,r->not_empty,r->writer_asleep);
   }
-  ostream.close();
-  if (tfile != nullptr) {
-    if (system(("mv "+tfile->name()+" "+args.cosfile).c_str()) != 0) {
-      std::cerr << "Error while removing COS-blocking" << std::endl;
-      exit(1);
+  return nullptr;
+}
+
+// pipe_records() hands each record of the first file in "istream" to
+// "write_record" on the calling thread while the reader thread decodes the
+// records that follow; it stops at the end of the file or when "write_record"
+// returns false, sets "num_read" to the number of records that were read, and
+// returns the status that ended the file (0 if "write_record" stopped it, and
+// bfstream::error if the reader thread could not be started)
+int pipe_records(imcstream& istream,std::function<bool(const unsigned char *,size_t)> write_record,size_t& num_read)
+{
+  BatchRing ring(istream);
+  pthread_t tid;
+  num_read=0;
+// without a reader thread only this conversion fails, and not the whole batch
+  if (pthread_create(&tid,nullptr,t_read,&ring) != 0) {
+    std::cerr << "Error creating reader thread" << std::endl;
+    return bfstream::error;
+  }
+  auto status=0;
+  auto done=false;
+  while (!done) {
+    auto tail=ring.tail.load(std::memory_order_relaxed);
+    wait_for(ring,ring.not_empty,ring.writer_asleep,
+    [&]() -> bool
+    {
+	return (ring.head.load(std::memory_order_acquire) != tail);
+    });
+    auto& batch=ring.batches[tail % NUM_BATCHES];
+    for (const auto& record : batch.records) {
+	++num_read;
+	if (!write_record((record.data != nullptr) ? record.data : batch.arena.data()+record.offset,record.length)) {
+	  done=true;
+	  break;
+	}
     }
+    if (!done && batch.status < 0) {
+	status=batch.status;
+	done=true;
+    }
+    ring.tail.store(tail+1,std::memory_order_release);
+    wake_up(ring,ring.not_full,ring.reader_asleep);
   }
-  std::cout << "\n  COS-blocked records read: " << istream.number_read() << std::endl;
-  std::cout << "  F77 records written: " << num_written << std::endl;
+  ring.stop.store(true,std::memory_order_release);
+  wake_up(ring,ring.not_full,ring.reader_asleep);
+  pthread_join(tid,nullptr);
+  return status;
 }
 
-void f77_to_cos()
+// is_read_error() is true for a status from pipe_records() that did not come
+// from the end of a file or the end of the data
+bool is_read_error(int status)
 {
-  if77stream istream;
-  if (!istream.open(args.non_cosfile.c_str())) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
-    exit(1);
+  return (status < 0 && status != bfstream::eof && status != craystream::eod);
+}
+
+// a SixBitStream joins the 6-bit characters of successive records into one
+// bit stream - the bits at the end of a record that do not make a whole
+// character are dropped, and the bits that do not make a whole output byte
+// are carried in "carry" to the next record
+struct SixBitStream {
+  SixBitStream() : carry(0),num_carry(0),buf() {}
+
+  unsigned long long carry;
+  size_t num_carry;
+  std::vector<unsigned char> buf;
+};
+
+// pack_6_bit() adds the characters of a record to the stream and returns the
+// number of whole bytes that are ready in "buf"
+size_t pack_6_bit(SixBitStream& stream,const unsigned char *record,size_t num_bytes)
+{
+  auto num_bits=num_bytes*8/6*6;
+  auto num_full=num_bits/8;
+  if (stream.buf.size() < num_full+1) {
+    stream.buf.resize(num_full+1);
   }
-  ocstream ostream;
-  if (!ostream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
-    exit(1);
+  auto out=stream.buf.data();
+  size_t n=0;
+  if (stream.num_carry == 0) {
+    std::copy(record,record+num_full,out);
+    n=num_full;
   }
-  const int BUF_LEN=500000;
-  std::unique_ptr<unsigned char []> buffer(new unsigned char[BUF_LEN+8]);
-  int num_bytes;
-  size_t num_written=0;
-  while ( (num_bytes=istream.read(&buffer[4],BUF_LEN)) != bfstream::eof) {
-    if (num_bytes == BUF_LEN) {
-	std::cerr << "Error: buffer not large enough" << std::endl;
-	exit(1);
+  else {
+// the carried bits go in front of each input word, and the bits that are
+// shifted out of the end of the word are carried into the next one
+    auto shift=stream.num_carry;
+    auto mask=(1ull << shift)-1;
+    for (; n+cosblock::word_size <= num_full; n+=cosblock::word_size) {
+	auto w=cosblock::word(&record[n]);
+	cosblock::pack(&out[n],(stream.carry << (64-shift)) | (w >> shift),cosblock::word_size);
+	stream.carry=w & mask;
+    }
+    for (; n < num_full; ++n) {
+	out[n]=(stream.carry << (8-shift)) | (record[n] >> shift);
+	stream.carry=record[n] & mask;
     }
-
-    bits::set(buffer.get(),num_bytes,0,32);
-    bits::set(buffer.get(),num_bytes,(num_bytes+4)*8,32);
-    ostream.write(buffer.get(),num_bytes+8);
-    ++num_written;
   }
-  ostream.close();
-  std::cout << "\n  F77 records read: " << istream.number_read() << std::endl;
-  std::cout << "  COS-blocked records written: " << num_written << std::endl;
+// the bits of the last character that are in the last byte used
+  auto num_last=num_bits % 8;
+  if (num_last > 0) {
+    stream.carry=(stream.carry << num_last) | (record[num_full] >> (8-num_last));
+    stream.num_carry+=num_last;
+    if (stream.num_carry >= 8) {
+	stream.num_carry-=8;
+	out[n++]=stream.carry >> stream.num_carry;
+	stream.carry&=(1ull << stream.num_carry)-1;
+    }
+  }
+  return n;
 }
 
-void grib_to_cos()
+// flush_6_bit() returns the carried bits, padded with zeros to a byte
+unsigned char flush_6_bit(SixBitStream& stream)
 {
-  InputGRIBStream grid_stream;
-  if (!grid_stream.open(args.non_cosfile.c_str())) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
-    exit(1);
+  auto byte=stream.carry << (8-stream.num_carry);
+  stream.carry=0;
+  stream.num_carry=0;
+  return byte;
+}
+
+// unpack_6_bit() puts each 6-bit character of a record, right-justified, in
+// its own 8-bit byte of "buf" and returns the number of characters - every
+// six bytes of the record hold eight whole characters
+size_t unpack_6_bit(const unsigned char *record,size_t num_bytes,std::vector<unsigned char>& buf)
+{
+  auto num_chars=num_bytes*8/6;
+  if (buf.size() < num_chars) {
+    buf.resize(num_chars);
   }
-  ocstream ostream;
-  if (!ostream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
-    exit(1);
+  size_t n=0,m=0;
+  for (; n+cosblock::word_size <= num_bytes; n+=6) {
+    auto w=cosblock::word(&record[n]) >> 16;
+    for (int k=42; k >= 0; k-=6) {
+	buf[m++]=(w >> k) & 0x3f;
+    }
   }
-  const size_t BUF_LEN=5000000;
-  std::unique_ptr<unsigned char []> buffer(new unsigned char[BUF_LEN]);
-  size_t num_written=0;
-  int num_bytes;
-  while ( (num_bytes=grid_stream.read(buffer.get(),BUF_LEN)) != bfstream::eof) {
-    ostream.write(buffer.get(),num_bytes);
-    ++num_written;
+  for (; m < num_chars; ++m) {
+    auto off=m*6;
+    unsigned int pair=record[off/8] << 8;
+    if (off/8+1 < num_bytes) {
+	pair|=record[off/8+1];
+    }
+    buf[m]=(pair >> (10-off % 8)) & 0x3f;
   }
-  ostream.close();
-  std::cout << "\n  GRIB grids read: " << grid_stream.number_read() << std::endl;
-  std::cout << "  COS-blocked records written: " << num_written << std::endl;
+  return num_chars;
 }
 
-void cos_to_rptout()
+bool cos_to_6_bit(ConvertJob& job)
 {
-  icstream istream;
-  if (!istream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
-    exit(1);
+  job.read_units="COS-blocked records";
+  job.written_units="Binary records";
+  imcstream istream;
+  if (!istream.open(job.cosfile.c_str())) {
+    return failed(job,"Error opening "+job.cosfile);
   }
-  TempFile *tfile=nullptr;
-  if (args.non_cosfile.length() == 0) {
-    tfile=new TempFile(".");
-    args.non_cosfile=tfile->name();
+  if (job.non_cosfile.length() == 0 && !make_temp_file(job)) {
+    return false;
   }
-  orstream ostream;
-  if (!ostream.open(args.non_cosfile.c_str())) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
-    exit(1);
+  std::ofstream ofs(output_path(job).c_str());
+  if (!ofs.is_open()) {
+    return failed(job,"Error opening "+job.non_cosfile);
   }
-  const int BUF_LEN=8000;
-  std::unique_ptr<unsigned char []> buffer(new unsigned char[BUF_LEN]);
-  int num_bytes;
-  while ( (num_bytes=istream.read(buffer.get(),BUF_LEN)) > 0) {
-    if (num_bytes == BUF_LEN) {
-	std::cerr << "Warning: buffer not large enough on record " << istream.number_read() << std::endl;
+  SixBitStream stream;
+  auto status=pipe_records(istream,
+  [&](const unsigned char *buffer,size_t num_bytes) -> bool
+  {
+    if (num_bytes == 0) {
+	return false;
     }
-    size_t block_len;
-    bits::get(buffer.get(),block_len,0,12);
-    ostream.write(buffer.get(),block_len);
-  }
-  ostream.close();
-  if (tfile != nullptr) {
-    if (system(("mv "+tfile->name()+" "+args.cosfile).c_str()) != 0) {
-      std::cerr << "Error while removing COS-blocking" << std::endl;
-      exit(1);
+    if (args.char_bits == 8) {
+	auto num_chars=unpack_6_bit(buffer,num_bytes,stream.buf);
+	ofs.write(reinterpret_cast<char *>(stream.buf.data()),num_chars);
+    }
+    else {
+	auto num_out=pack_6_bit(stream,buffer,num_bytes);
+	ofs.write(reinterpret_cast<char *>(stream.buf.data()),num_out);
     }
+    ++job.num_written;
+    return true;
+  },job.num_read);
+  if (is_read_error(status)) {
+    return failed(job,"Error reading "+job.cosfile);
+  }
+  if (stream.num_carry > 0) {
+    ofs.put(flush_6_bit(stream));
   }
-  std::cout << "\n  COS-blocked records read: " << istream.number_read() << std::endl;
-  std::cout << "  Binary Rptout records written: " << ostream.number_written() << std::endl;
+  ofs.close();
+  if (!ofs) {
+    return failed(job,"Error writing "+job.non_cosfile);
+  }
+  if (job.temp_file.length() > 0) {
+    return replace_cosfile(job);
+  }
+  return true;
 }
 
-void rptout_to_cos()
+// with --in-place, the data of the records are written back over the
+// COS-blocked file and the file is then cut to their length - the data of a
+// record always land ahead of the control words that preceded it, so nothing
+// is overwritten before it has been read, but unlike the rename() the
+// conversion can not be undone if it is interrupted
+bool cos_to_binary_in_place(ConvertJob& job)
 {
-  FILE *fp;
-  if ( (fp=fopen(args.non_cosfile.c_str(),"r")) == NULL) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
-    exit(1);
+  job.read_units="COS-blocked records";
+  job.written_units="Binary records";
+  imcstream istream;
+  if (!istream.open(job.cosfile.c_str())) {
+    return failed(job,"Error opening "+job.cosfile+" for input");
   }
-  ocstream ostream;
-  if (!ostream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
-    exit(1);
+// the decompressed data of a compressed cosfile would run ahead of what has
+// been read, and a pipe can not be written back to
+  if (istream.is_stream()) {
+    return failed(job,"Error: --in-place needs a cosfile that is neither compressed nor a pipe");
   }
-  std::unique_ptr<unsigned char []> buffer(new unsigned char[8000]);
-  size_t num_read=0,num_written=0;
-  while (fread(buffer.get(),1,8,fp) > 0) {
-    size_t num_bytes;
-    bits::get(buffer.get(),num_bytes,32,32);
-    num_bytes*=8;
-    if (fread(&buffer[8],1,num_bytes-8,fp) != num_bytes - 8) {
-      std::cerr << "Error while reading rptout file" << std::endl;
-      exit(1);
+  auto fd=open(job.cosfile.c_str(),O_WRONLY);
+  if (fd < 0) {
+    return failed(job,"Error opening "+job.cosfile+" for output");
+  }
+  off_t offset=0;
+  auto write_failed=false;
+  std::vector<unsigned char> copy;
+  auto status=pipe_records(istream,
+  [&](const unsigned char *buffer,size_t num_bytes) -> bool
+  {
+    if (num_bytes == 0) {
+	return false;
     }
-    ++num_read;
-    ostream.write(buffer.get(),num_bytes);
-    ++num_written;
+// a record can be a view into the mapping of this same file, just past where
+// it is written, and pwrite() does not promise to copy from a buffer that
+// overlaps its own output - so the record is copied out of the way first
+    copy.assign(buffer,buffer+num_bytes);
+    buffer=copy.data();
+    while (num_bytes > 0) {
+	auto n=pwrite(fd,buffer,num_bytes,offset);
+	if (n < 0) {
+	  if (errno == EINTR) {
+	    continue;
+	  }
+	  write_failed=true;
+	  return false;
+	}
+	buffer+=n;
+	num_bytes-=n;
+	offset+=n;
+    }
+    ++job.num_written;
+    return true;
+  },job.num_read);
+// the empty record that ends the data was only peeked at before the reader
+// thread, and is not counted as read
+  if (status == 0 && !write_failed) {
+    --job.num_read;
   }
-  ostream.close();
-  std::cout << "\n  Rptout blocks read: " << num_read << std::endl;
-  std::cout << "  COS-blocked records written: " << num_written << std::endl;
+  if (write_failed || ftruncate(fd,offset) != 0 || (args.sync && fsync(fd) != 0)) {
+    close(fd);
+    return failed(job,"Error while removing COS-blocking");
+  }
+  close(fd);
+  if (is_read_error(status)) {
+    return failed(job,"Error reading "+job.cosfile);
+  }
+  return true;
 }
 
-void cos_to_vbs()
+bool cos_to_binary(ConvertJob& job)
 {
-  icstream istream;
-  if (!istream.open(args.cosfile.c_str())) {
-    std::cerr << "Error opening " << args.cosfile << std::endl;
-    exit(1);
+  if (args.in_place) {
+    return cos_to_binary_in_place(job);
   }
-  TempFile *tfile=nullptr;
-  if (args.non_cosfile.length() == 0) {
-    tfile=new TempFile(".");
-    args.non_cosfile=tfile->name();
+  job.read_units="COS-blocked records";
+  job.written_units="Binary records";
+  imcstream istream;
+  if (!istream.open(job.cosfile.c_str())) {
+    return failed(job,"Error opening "+job.cosfile+" for input");
   }
-  FILE *fp;
-  if ( (fp=fopen(args.non_cosfile.c_str(),"w")) == NULL) {
-    std::cerr << "Error opening " << args.non_cosfile << std::endl;
-    exit(1);
+  if (job.non_cosfile.length() == 0 && !make_temp_file(job)) {
+    return false;
   }
-  const int BUF_LEN=500000;
-  std::unique_ptr<unsigned char []> buffer(new unsigned char[BUF_LEN]);
-  int num_written=0;
-  int num_bytes;
-  while ( (num_bytes=istream.read(buffer.get(),BUF_LEN)) > 0) {
-    if (num_bytes == BUF_LEN) {
-	std::cerr << "Warning: buffer not large enough on record " << istream.number_read() << std::endl;
-    }
-    size_t block_len;
-    bits::get(buffer.get(),block_len,0,16);
-    fwrite(buffer.get(),1,block_len,fp);
-    ++num_written;
+  std::ofstream ofs(output_path(job).c_str());
+  if (!ofs.is_open()) {
+    return failed(job,"Error opening "+job.non_cosfile+" for output");
   }
-  fclose(fp);
-  if (tfile != nullptr) {
-    if (system(("mv "+tfile->name()+" "+args.cosfile).c_str()) != 0) {
-      std::cerr << "Error while removing COS-blocking" << std::endl;
-      exit(1);
+  std::unique_ptr<unsigned char []> blank(new unsigned char[args.recln]);
+  for (int n=0; n < args.recln; ++n) {
+    blank[n]=0;
+  }
+  auto status=pipe_records(istream,
+  [&](const unsigned char *buffer,size_t num_bytes) -> bool
+  {
+    if (num_bytes == 0) {
+	return false;
     }
+    if (args.recln == 0) {
+	ofs.write(reinterpret_cast<const char *>(buffer),num_bytes);
+    }
+    else {
+	if (static_cast<size_t>(args.recln) > num_bytes) {
+	  ofs.write(reinterpret_cast<const char *>(buffer),num_bytes);
+	  auto fill=args.recln-num_bytes;
+	  ofs.write(reinterpret_cast<char *>(blank.get()),fill);
+	}
+	else {
+	  ofs.write(reinterpret_cast<const char *>(buffer),args.recln);
+	}
+    }
+    ++job.num_written;
+    return true;
+  },job.num_read);
+// the empty record that ends the data was only peeked at before the reader
+// thread, and is not counted as read
+  if (status == 0) {
+    --job.num_read;
+  }
+  if (is_read_error(status)) {
+    return failed(job,"Error reading "+job.cosfile);
+  }
+  ofs.close();
+  if (!ofs) {
+    return failed(job,"Error writing "+job.non_cosfile);
   }
-  std::cout << "\n  COS-blocked records read: " << istream.number_read() << std::endl;
-  std::cout << "  Binary VBS records written: " << num_written << std::endl;
+  if (job.temp_file.length() > 0) {
+    return replace_cosfile(job);
+  }
+  return true;
 }
 
-int main(int argc,char **argv)
+bool binary_to_cos(ConvertJob& job)
 {
-  if (argc < 3) {
-    std::cerr << "usage: " << argv[0] << " flag cosfile {non-cosfile}" << std::endl;
-    std::cerr << "\nfunction: to convert files between COS-blocked and other formats" << std::endl;
-    std::cerr << std::endl;
-    std::cerr << "a conversion flag is required (choose one):" << std::endl;
-    std::cerr << "-6          convert COS-blocked binary to 6-bit stream" << std::endl;
-    std::cerr << "-b <recln>  convert COS-blocked binary to plain binary, specifying an optional" << std::endl;
-    std::cerr << "              <recln> to force the record length" << std::endl;
-    std::cerr << "-B <recln>  convert plain binary to COS-blocked binary, specifying an optional" << std::endl;
-    std::cerr << "              <recln> for the binary record length (default is 32768)" << std::endl;
-    std::cerr << "-c          convert COS-blocked ASCII to UNIX ASCII" << std::endl;
-    std::cerr << "-C          convert UNIX ASCII to COS-blocked ASCII" << std::endl;
-    std::cerr << "-f <endian> convert COS-blocked binary to F77 <endian>-endian binary, where" << std::endl;
-    std::cerr << "              <endian> is \"big\" or \"little\"" << std::endl;
-    std::cerr << "-F          convert F77 binary to COS-blocked F77 binary" << std::endl;
-    std::cerr << "-G          convert plain binary GRIB to COS-blocked GRIB" << std::endl;
-    std::cerr << "-r          convert COS-blocked rptout to binary rptout" << std::endl;
-    std::cerr << "-R          convert binary rptout to COS-blocked rptout" << std::endl;
-    std::cerr << "-v          convert COS-blocked IBM VBS to binary IBM VBS" << std::endl;
-    std::cerr << std::endl;
-    std::cerr << "file name inclusion:" << std::endl;
-    std::cerr << "cosfile: (the name of the COS-blocked file) is always required" << std::endl;
-    std::cerr << "non-cosfile: (the name of the non-COS-blocked file) is:" << std::endl;
-    std::cerr << "  required when ADDING COS-blocking" << std::endl;
-    std::cerr << "  optional when REMOVING COS-blocking (if not included, cosfile will be" << std::endl;
-    std::cerr << "    overwritten)" << std::endl;
-    exit(1);
+  job.read_units="Binary records";
+  job.written_units="COS-blocked records";
+  FILE *fp;
+  if ( (fp=fopen(input_path(job).c_str(),"r")) == NULL) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  omcstream ostream;
+  if (!ostream.open(output_path(job).c_str(),args.no_cache)) {
+    fclose(fp);
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  std::unique_ptr<unsigned char []> buffer(new unsigned char[args.recln]);
+  size_t len;
+  while ( (len=fread(buffer.get(),1,args.recln,fp)) > 0) {
+    ++job.num_read;
+    ostream.write(buffer.get(),len);
+    ++job.num_written;
+  }
+  fclose(fp);
+  if (!ostream.close()) {
+    return failed(job,"Error writing "+job.cosfile);
+  }
+  return true;
+}
+
+bool cos_to_unix(ConvertJob& job)
+{
+  job.read_units="COS-blocked records";
+  job.written_units="Unix records";
+  imcstream istream;
+  if (!istream.open(job.cosfile.c_str())) {
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  if (job.non_cosfile.length() == 0 && !make_temp_file(job)) {
+    return false;
+  }
+  FILE *fp;
+  if ( (fp=fopen(output_path(job).c_str(),"w")) == NULL) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  auto status=pipe_records(istream,
+  [&](const unsigned char *buffer,size_t num_bytes) -> bool
+  {
+    fwrite(buffer,1,num_bytes,fp);
+    fputc(0xa,fp);
+    ++job.num_written;
+    return true;
+  },job.num_read);
+  if (is_read_error(status)) {
+    fclose(fp);
+    return failed(job,"Error reading "+job.cosfile);
+  }
+  if (ferror(fp) != 0 || fclose(fp) != 0) {
+    return failed(job,"Error writing "+job.non_cosfile);
+  }
+  if (job.temp_file.length() > 0) {
+    return replace_cosfile(job);
+  }
+  return true;
+}
+
+// split_lines() writes each line in "text" as a COS-blocked record - a line
+// that runs past the end of "text" is left open in "ostream", with "in_line"
+// set, for the text that follows to finish
+bool split_lines(ConvertJob& job,omcstream& ostream,const unsigned char *text,size_t length,bool& in_line)
+{
+  auto p=text,end=text+length;
+  while (p < end) {
+    auto eol=reinterpret_cast<const unsigned char *>(memchr(p,0xa,end-p));
+    if (eol == nullptr) {
+	in_line=true;
+	return (ostream.write_part(p,end-p) != bfstream::error);
+    }
+    ++job.num_read;
+    if (ostream.write(p,eol-p) == bfstream::error) {
+	return false;
+    }
+    ++job.num_written;
+    in_line=false;
+    p=eol+1;
+  }
+  return true;
+}
+
+// the text file is mapped into memory and each line is found with memchr()
+// and written straight from the mapping as a COS-blocked record, so a line
+// can be of any length - a last line without a newline is also a record; text
+// that can not be mapped (a pipe, or standard input as "-") is read in chunks
+bool unix_to_cos(ConvertJob& job)
+{
+  job.read_units="UNIX records";
+  job.written_units="COS-blocked records";
+  auto fd=(job.non_cosfile == "-") ? STDIN_FILENO : open(job.non_cosfile.c_str(),O_RDONLY);
+  if (fd < 0) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  struct stat buf;
+  if (fstat(fd,&buf) != 0) {
+    close(fd);
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  size_t map_len=(S_ISREG(buf.st_mode)) ? buf.st_size : 0;
+  const unsigned char *map=nullptr;
+  if (map_len > 0) {
+    auto m=mmap(nullptr,map_len,PROT_READ,MAP_PRIVATE,fd,0);
+    if (m == MAP_FAILED) {
+	close(fd);
+	return failed(job,"Error mapping "+job.non_cosfile);
+    }
+    map=reinterpret_cast<const unsigned char *>(m);
+    madvise(m,map_len,MADV_SEQUENTIAL);
+  }
+  omcstream ostream;
+  if (!ostream.open(output_path(job).c_str(),args.no_cache)) {
+    if (map != nullptr) {
+	munmap(const_cast<unsigned char *>(map),map_len);
+    }
+    close(fd);
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  auto in_line=false,write_failed=false,read_failed=false;
+  if (map != nullptr) {
+    write_failed=!split_lines(job,ostream,map,map_len,in_line);
+    munmap(const_cast<unsigned char *>(map),map_len);
+  }
+  else if (!S_ISREG(buf.st_mode)) {
+    const size_t CHUNK_LEN=1048576;
+    std::unique_ptr<unsigned char []> chunk(new unsigned char[CHUNK_LEN]);
+    while (!write_failed) {
+	auto n=read(fd,chunk.get(),CHUNK_LEN);
+	if (n < 0 && errno == EINTR) {
+	  continue;
+	}
+	if (n <= 0) {
+	  read_failed=(n < 0);
+	  break;
+	}
+	write_failed=!split_lines(job,ostream,chunk.get(),n,in_line);
+    }
+  }
+  close(fd);
+  if (in_line && !write_failed) {
+    ++job.num_read;
+    write_failed=(ostream.write(nullptr,0) == bfstream::error);
+    ++job.num_written;
+  }
+  if (!ostream.close()) {
+    write_failed=true;
+  }
+  if (read_failed) {
+    return failed(job,"Error reading "+job.non_cosfile);
+  }
+  if (write_failed) {
+    return failed(job,"Error writing "+job.cosfile);
+  }
+  return true;
+}
+
+// an F77Writer assembles records and their length markers in one large buffer
+// and writes the buffer when it fills - a record that would take up a large
+// part of the buffer is not copied, but goes out behind the buffered data in
+// the same writev()
+const size_t F77_BUFFER_BYTES=4194304;
+
+struct F77Writer {
+  F77Writer() : fd(-1),buf(F77_BUFFER_BYTES),len(0),marker_size(4),big_endian(true) {}
+
+  int fd;
+  std::vector<unsigned char> buf;
+  size_t len,marker_size;
+  bool big_endian;
+};
+
+void put_marker(const F77Writer& writer,unsigned char *marker,size_t value)
+{
+  if (writer.big_endian) {
+    cosblock::pack(marker,value,writer.marker_size);
+  }
+  else {
+    for (size_t n=0; n < writer.marker_size; ++n) {
+	marker[n]=value & 0xff;
+	value>>=8;
+    }
+  }
+}
+
+bool write_all(int fd,struct iovec *iov,int iovcnt)
+{
+  while (iovcnt > 0) {
+    auto n=writev(fd,iov,iovcnt);
+    if (n < 0) {
+	if (errno == EINTR) {
+	  continue;
+	}
+	return false;
+    }
+// skip what was written, which can end in the middle of a vector
+    while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+	n-=iov->iov_len;
+	++iov;
+	--iovcnt;
+    }
+    if (iovcnt > 0) {
+	iov->iov_base=reinterpret_cast<char *>(iov->iov_base)+n;
+	iov->iov_len-=n;
+    }
+  }
+  return true;
+}
+
+bool flush_f77(F77Writer& writer)
+{
+  struct iovec iov;
+  iov.iov_base=writer.buf.data();
+  iov.iov_len=writer.len;
+  writer.len=0;
+  return write_all(writer.fd,&iov,1);
+}
+
+bool write_f77_record(F77Writer& writer,const unsigned char *data,size_t num_bytes)
+{
+// a 4-byte marker can not hold the length of a record of 4 GB or more
+  if (writer.marker_size < 8 && num_bytes > 0xffffffff) {
+    errno=EFBIG;
+    return false;
+  }
+  if (num_bytes >= writer.buf.size()/4) {
+    unsigned char marker[8];
+    put_marker(writer,marker,num_bytes);
+    struct iovec iov[4];
+    iov[0].iov_base=writer.buf.data();
+    iov[0].iov_len=writer.len;
+    iov[1].iov_base=marker;
+    iov[1].iov_len=writer.marker_size;
+    iov[2].iov_base=const_cast<unsigned char *>(data);
+    iov[2].iov_len=num_bytes;
+    iov[3].iov_base=marker;
+    iov[3].iov_len=writer.marker_size;
+    writer.len=0;
+    return write_all(writer.fd,iov,4);
+  }
+  if (writer.len+num_bytes+2*writer.marker_size > writer.buf.size() && !flush_f77(writer)) {
+    return false;
+  }
+  auto p=&writer.buf[writer.len];
+  put_marker(writer,p,num_bytes);
+  p+=writer.marker_size;
+  std::copy(data,data+num_bytes,p);
+  p+=num_bytes;
+  put_marker(writer,p,num_bytes);
+  writer.len+=num_bytes+2*writer.marker_size;
+  return true;
+}
+
+bool cos_to_f77(ConvertJob& job)
+{
+  job.read_units="COS-blocked records";
+  job.written_units="F77 records";
+  imcstream istream;
+  if (!istream.open(job.cosfile.c_str())) {
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  if (job.non_cosfile.length() == 0 && !make_temp_file(job)) {
+    return false;
+  }
+  F77Writer writer;
+  if ( (writer.fd=open(output_path(job).c_str(),O_WRONLY | O_CREAT | O_TRUNC,0666)) < 0) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  writer.marker_size=args.marker_size;
+  writer.big_endian=args.big_endian;
+  auto write_failed=false,too_long=false;
+  auto status=pipe_records(istream,
+  [&](const unsigned char *buffer,size_t num_bytes) -> bool
+  {
+    if (!write_f77_record(writer,buffer,num_bytes)) {
+	write_failed=true;
+	too_long=(errno == EFBIG);
+	return false;
+    }
+    ++job.num_written;
+    return true;
+  },job.num_read);
+  if (!write_failed && !flush_f77(writer)) {
+    write_failed=true;
+  }
+  if (close(writer.fd) != 0 || write_failed) {
+    if (too_long) {
+	return failed(job,"Error: record "+std::to_string(job.num_read)+" is too long for 4-byte F77 record markers - use --marker-size 8");
+    }
+    return failed(job,"Error writing "+job.non_cosfile);
+  }
+  if (is_read_error(status)) {
+    return failed(job,"Error reading "+job.cosfile);
+  }
+  if (job.temp_file.length() > 0) {
+    return replace_cosfile(job);
+  }
+  return true;
+}
+
+bool f77_to_cos(ConvertJob& job)
+{
+  job.read_units="F77 records";
+  job.written_units="COS-blocked records";
+  if77stream istream;
+  if (!istream.open(input_path(job).c_str())) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  omcstream ostream;
+  if (!ostream.open(output_path(job).c_str(),args.no_cache)) {
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  const int BUF_LEN=500000;
+  std::unique_ptr<unsigned char []> buffer(new unsigned char[BUF_LEN+8]);
+  int num_bytes;
+  while ( (num_bytes=istream.read(&buffer[4],BUF_LEN)) != bfstream::eof) {
+    if (num_bytes == BUF_LEN) {
+	ostream.close();
+	return failed(job,"Error: buffer not large enough");
+    }
+
+    bits::set(buffer.get(),num_bytes,0,32);
+    bits::set(buffer.get(),num_bytes,(num_bytes+4)*8,32);
+    ostream.write(buffer.get(),num_bytes+8);
+    ++job.num_written;
+  }
+  job.num_read=istream.number_read();
+  if (!ostream.close()) {
+    return failed(job,"Error writing "+job.cosfile);
+  }
+  return true;
+}
+
+bool grib_to_cos(ConvertJob& job)
+{
+  job.read_units="GRIB grids";
+  job.written_units="COS-blocked records";
+  InputGRIBStream grid_stream;
+  if (!grid_stream.open(input_path(job).c_str())) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  omcstream ostream;
+  if (!ostream.open(output_path(job).c_str(),args.no_cache)) {
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  const size_t BUF_LEN=5000000;
+  std::unique_ptr<unsigned char []> buffer(new unsigned char[BUF_LEN]);
+  int num_bytes;
+  while ( (num_bytes=grid_stream.read(buffer.get(),BUF_LEN)) != bfstream::eof) {
+    ostream.write(buffer.get(),num_bytes);
+    ++job.num_written;
+  }
+  job.num_read=grid_stream.number_read();
+  if (!ostream.close()) {
+    return failed(job,"Error writing "+job.cosfile);
+  }
+  return true;
+}
+
+// spare_threads() is the number of threads that one conversion can use for its
+// own work - the CPUs are shared among the jobs of a batch
+size_t spare_threads(size_t max_threads)
+{
+  auto num_cpus=sysconf(_SC_NPROCESSORS_ONLN);
+  auto num_threads=(num_cpus > 0) ? num_cpus/args.num_jobs : 1;
+  return std::min(std::max(num_threads,static_cast<size_t>(1)),max_threads);
+}
+
+// with --check, every rptout block is checked for a valid length and for the
+// add-and-carry checksum in its last word (the checksum that readlmr6 uses) as
+// it is converted - the blocks are checked in batches, several threads to a
+// batch, and a block that fails is listed in the report instead of being
+// written to the output
+const size_t CHECK_BATCH_BLOCKS=4096;
+const size_t MAX_CHECK_THREADS=8;
+
+struct RptoutBlock {
+  RptoutBlock(size_t offset,size_t length,size_t number) : offset(offset),length(length),number(number),problem(nullptr) {}
+
+  size_t offset,length,number;
+  const char *problem;
+};
+struct RptoutBatch {
+  RptoutBatch() : arena(),blocks(),lengths_checked(false) {}
+
+  std::vector<unsigned char> arena;
+  std::vector<RptoutBlock> blocks;
+  bool lengths_checked;
+};
+struct CheckSlice {
+  CheckSlice() : batch(nullptr),first(0),last(0) {}
+
+  RptoutBatch *batch;
+  size_t first,last;
+};
+struct Report {
+  Report() : fp(nullptr),lock(PTHREAD_MUTEX_INITIALIZER) {}
+
+  FILE *fp;
+  pthread_mutex_t lock;
+} report;
+
+// a block starts with a 4-bit flag, which is 0 for 60-bit words and 1 for
+// 64-bit words, and holds the number of words in the block (the last of which
+// is the checksum) in the 32 bits that follow the first 28 + 4*flag bits
+size_t rptout_word_size(const unsigned char *block)
+{
+  return 60+(block[0] >> 4)*4;
+}
+
+size_t rptout_word_count(const unsigned char *block)
+{
+  return (block[0] >> 4 == 0) ? cosblock::unpack(&block[3],5) >> 4 & 0xffffffff : cosblock::unpack(&block[4],4);
+}
+
+// rptout_block_length() returns the number of bytes in a block, or 0 with
+// "problem" set if the block can not be one - "available" is the number of
+// bytes that the block can take up
+size_t rptout_block_length(const unsigned char *block,size_t available,const char *& problem)
+{
+  if (available < 8) {
+    problem="block is too short";
+    return 0;
+  }
+  if ((block[0] >> 4) > 1) {
+    problem="bad word-size flag";
+    return 0;
+  }
+  auto word_size=rptout_word_size(block);
+  auto num_words=rptout_word_count(block);
+  if (num_words < 2 || num_words*word_size > 8000*8) {
+    problem="bad word count";
+    return 0;
+  }
+  auto length=(num_words*word_size+7)/8;
+  if (length > available) {
+    problem="block runs past the end of its record";
+    return 0;
+  }
+  return length;
+}
+
+// the 60-bit sum wraps with an end-around carry, and the 64-bit sum simply
+// wraps
+bool rptout_checksum_ok(const unsigned char *block)
+{
+  auto word_size=rptout_word_size(block);
+  auto num_words=rptout_word_count(block);
+  unsigned long long sum=0,word=0;
+  for (size_t n=0; n < num_words; ++n) {
+    if (word_size == 64) {
+	word=cosblock::word(&block[n*8]);
+    }
+    else {
+	auto bit=n*60;
+	word=(cosblock::word(&block[bit/8]) >> (4-bit % 8)) & 0xfffffffffffffffULL;
+    }
+    if (n == num_words-1) {
+	break;
+    }
+    sum+=word;
+    if (word_size == 60 && sum >= (1ULL << 60)) {
+	sum-=(1ULL << 60)-1;
+    }
+  }
+  return (word == sum);
+}
+
+extern "C" void *t_check(void *s)
+{
+  CheckSlice *slice=reinterpret_cast<CheckSlice *>(s);
+  auto& batch=*slice->batch;
+  for (size_t n=slice->first; n < slice->last; ++n) {
+    auto& block=batch.blocks[n];
+    auto data=&batch.arena[block.offset];
+    if (!batch.lengths_checked && (block.length=rptout_block_length(data,block.length,block.problem)) == 0) {
+	continue;
+    }
+    if (!rptout_checksum_ok(data)) {
+	block.problem="checksum error";
+    }
+  }
+  return nullptr;
+}
+
+void check_batch(RptoutBatch& batch)
+{
+  auto num_threads=std::min(spare_threads(MAX_CHECK_THREADS),batch.blocks.size());
+  std::vector<CheckSlice> slices(num_threads);
+  std::vector<pthread_t> tids(num_threads);
+  size_t num_started=0;
+  for (size_t n=0; n < num_threads; ++n) {
+    slices[n].batch=&batch;
+    slices[n].first=batch.blocks.size()*n/num_threads;
+    slices[n].last=batch.blocks.size()*(n+1)/num_threads;
+    if (n > 0) {
+	if (pthread_create(&tids[n],nullptr,t_check,&slices[n]) != 0) {
+	  t_check(&slices[n]);
+	}
+	else {
+	  ++num_started;
+	}
+    }
+  }
+  if (num_threads > 0) {
+    t_check(&slices[0]);
+  }
+  for (size_t n=1; n <= num_started; ++n) {
+    pthread_join(tids[n],nullptr);
+  }
+}
+
+void report_block(std::string filename,const RptoutBlock& block)
+{
+  pthread_mutex_lock(&report.lock);
+  fprintf(report.fp,"%s: block %zu: %s\n",filename.c_str(),block.number,block.problem);
+  pthread_mutex_unlock(&report.lock);
+}
+
+// write_checked_blocks() checks a batch of blocks from "filename" and hands
+// each good block to "write" - the bad blocks are reported and counted
+bool write_checked_blocks(ConvertJob& job,std::string filename,RptoutBatch& batch,std::function<bool(const unsigned char *,size_t)> write)
+{
+  check_batch(batch);
+  for (const auto& block : batch.blocks) {
+    if (block.problem != nullptr) {
+	report_block(filename,block);
+	++job.num_bad;
+    }
+    else {
+	if (!write(&batch.arena[block.offset],block.length)) {
+	  return false;
+	}
+	++job.num_written;
+    }
+  }
+  batch.arena.clear();
+  batch.blocks.clear();
+  return true;
+}
+
+bool cos_to_rptout_checked(ConvertJob& job)
+{
+  job.read_units="COS-blocked records";
+  job.written_units="Binary Rptout records";
+  imcstream istream;
+  if (!istream.open(job.cosfile.c_str())) {
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  if (job.non_cosfile.length() == 0 && !make_temp_file(job)) {
+    return false;
+  }
+  orstream ostream;
+  if (!ostream.open(output_path(job).c_str())) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  auto write=[&](const unsigned char *data,size_t length) -> bool
+  {
+    return (ostream.write(data,length) >= 0);
+  };
+  RptoutBatch batch;
+  auto write_failed=false;
+  auto status=pipe_records(istream,
+  [&](const unsigned char *buffer,size_t num_bytes) -> bool
+  {
+    if (num_bytes == 0) {
+	return false;
+    }
+// each COS-blocked record holds one block, and its length is checked with
+// the checksum
+    batch.blocks.emplace_back(batch.arena.size(),num_bytes,job.num_read);
+    batch.arena.insert(batch.arena.end(),buffer,buffer+num_bytes);
+    if (batch.blocks.size() == CHECK_BATCH_BLOCKS && !write_checked_blocks(job,job.cosfile,batch,write)) {
+	write_failed=true;
+	return false;
+    }
+    return true;
+  },job.num_read);
+  if (!write_failed && !write_checked_blocks(job,job.cosfile,batch,write)) {
+    write_failed=true;
+  }
+  ostream.close();
+  if (write_failed) {
+    return failed(job,"Error writing "+job.non_cosfile);
+  }
+  if (is_read_error(status)) {
+    return failed(job,"Error reading "+job.cosfile);
+  }
+  if (job.temp_file.length() > 0) {
+    return replace_cosfile(job);
+  }
+  return true;
+}
+
+// the blocks of a binary rptout file follow one another, so a block with a bad
+// length ends the conversion, as the start of the next block can not be found
+bool rptout_to_cos_checked(ConvertJob& job)
+{
+  job.read_units="Rptout blocks";
+  job.written_units="COS-blocked records";
+  FILE *fp;
+  if ( (fp=fopen(input_path(job).c_str(),"r")) == NULL) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  omcstream ostream;
+  if (!ostream.open(output_path(job).c_str(),args.no_cache)) {
+    fclose(fp);
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  auto write=[&](const unsigned char *data,size_t length) -> bool
+  {
+    return (ostream.write(data,length) != bfstream::error);
+  };
+  RptoutBatch batch;
+  batch.lengths_checked=true;
+  unsigned char header[8];
+  const char *problem=nullptr;
+  auto write_failed=false;
+  size_t num_bytes;
+  while (!write_failed && (num_bytes=fread(header,1,8,fp)) > 0) {
+    ++job.num_read;
+    size_t length=0;
+    if ( (length=rptout_block_length(header,(num_bytes < 8) ? num_bytes : 8000,problem)) == 0) {
+	break;
+    }
+// a block in a binary file fills whole 64-bit words
+    if (rptout_word_size(header) != 64) {
+	problem="bad word-size flag";
+	break;
+    }
+    auto offset=batch.arena.size();
+    batch.arena.resize(offset+length);
+    std::copy(header,header+8,&batch.arena[offset]);
+    if (fread(&batch.arena[offset+8],1,length-8,fp) != length-8) {
+	problem="block runs past the end of the file";
+	break;
+    }
+    batch.blocks.emplace_back(offset,length,job.num_read);
+    if (batch.blocks.size() == CHECK_BATCH_BLOCKS) {
+	write_failed=!write_checked_blocks(job,job.non_cosfile,batch,write);
+    }
+  }
+  fclose(fp);
+  if (!write_failed) {
+    write_failed=!write_checked_blocks(job,job.non_cosfile,batch,write);
+  }
+  if (!ostream.close()) {
+    write_failed=true;
+  }
+  if (write_failed) {
+    return failed(job,"Error writing "+job.cosfile);
+  }
+  if (problem != nullptr) {
+    RptoutBlock block(0,0,job.num_read);
+    block.problem=problem;
+    report_block(job.non_cosfile,block);
+    ++job.num_bad;
+    return failed(job,"Error: rptout block "+strutils::itos(job.num_read)+" of "+job.non_cosfile+": "+problem);
+  }
+  return true;
+}
+
+bool cos_to_rptout(ConvertJob& job)
+{
+  if (args.check.length() > 0) {
+    return cos_to_rptout_checked(job);
+  }
+  job.read_units="COS-blocked records";
+  job.written_units="Binary Rptout records";
+  imcstream istream;
+  if (!istream.open(job.cosfile.c_str())) {
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  if (job.non_cosfile.length() == 0 && !make_temp_file(job)) {
+    return false;
+  }
+  orstream ostream;
+  if (!ostream.open(output_path(job).c_str())) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  auto status=pipe_records(istream,
+  [&](const unsigned char *buffer,size_t num_bytes) -> bool
+  {
+    if (num_bytes == 0) {
+	return false;
+    }
+// the block length is in the first 12 bits, and the block can not run past
+// the end of the record
+    size_t block_len=num_bytes;
+    if (num_bytes > 1) {
+	bits::get(buffer,block_len,0,12);
+	if (block_len > num_bytes) {
+	  block_len=num_bytes;
+	}
+    }
+    ostream.write(buffer,block_len);
+    return true;
+  },job.num_read);
+  ostream.close();
+  job.num_written=ostream.number_written();
+  if (is_read_error(status)) {
+    return failed(job,"Error reading "+job.cosfile);
+  }
+  if (job.temp_file.length() > 0) {
+    return replace_cosfile(job);
+  }
+  return true;
+}
+
+bool rptout_to_cos(ConvertJob& job)
+{
+  if (args.check.length() > 0) {
+    return rptout_to_cos_checked(job);
+  }
+  job.read_units="Rptout blocks";
+  job.written_units="COS-blocked records";
+  FILE *fp;
+  if ( (fp=fopen(input_path(job).c_str(),"r")) == NULL) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  omcstream ostream;
+  if (!ostream.open(output_path(job).c_str(),args.no_cache)) {
+    fclose(fp);
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  std::unique_ptr<unsigned char []> buffer(new unsigned char[8000]);
+  while (fread(buffer.get(),1,8,fp) > 0) {
+    size_t num_bytes;
+    bits::get(buffer.get(),num_bytes,32,32);
+    num_bytes*=8;
+    if (num_bytes < 8 || num_bytes > 8000 || fread(&buffer[8],1,num_bytes-8,fp) != num_bytes - 8) {
+	fclose(fp);
+	ostream.close();
+	return failed(job,"Error while reading rptout file");
+    }
+    ++job.num_read;
+    ostream.write(buffer.get(),num_bytes);
+    ++job.num_written;
+  }
+  fclose(fp);
+  if (!ostream.close()) {
+    return failed(job,"Error writing "+job.cosfile);
+  }
+  return true;
+}
+
+bool cos_to_vbs(ConvertJob& job)
+{
+  job.read_units="COS-blocked records";
+  job.written_units="Binary VBS records";
+  imcstream istream;
+  if (!istream.open(job.cosfile.c_str())) {
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  if (job.non_cosfile.length() == 0 && !make_temp_file(job)) {
+    return false;
+  }
+  FILE *fp;
+  if ( (fp=fopen(output_path(job).c_str(),"w")) == NULL) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  auto status=pipe_records(istream,
+  [&](const unsigned char *buffer,size_t num_bytes) -> bool
+  {
+    if (num_bytes == 0) {
+	return false;
+    }
+// the block descriptor word starts with the length of the block
+    size_t block_len=num_bytes;
+    if (num_bytes > 1) {
+	bits::get(buffer,block_len,0,16);
+	if (block_len > num_bytes) {
+	  block_len=num_bytes;
+	}
+    }
+    fwrite(buffer,1,block_len,fp);
+    ++job.num_written;
+    return true;
+  },job.num_read);
+  if (is_read_error(status)) {
+    fclose(fp);
+    return failed(job,"Error reading "+job.cosfile);
+  }
+  if (ferror(fp) != 0 || fclose(fp) != 0) {
+    return failed(job,"Error writing "+job.non_cosfile);
+  }
+  if (job.temp_file.length() > 0) {
+    return replace_cosfile(job);
+  }
+  return true;
+}
+
+// with -X, a RecordReader for the format of the input hands each record to a
+// RecordWriter for the format of the output, so that a conversion between any
+// two formats takes one pass - a record is a view that stays valid until the
+// next read(), which returns its length, bfstream::eof at the end of a COS
+// file, craystream::eod at the end of the data, or bfstream::error
+class RecordReader
+{
+public:
+  virtual ~RecordReader() {}
+  virtual bool open(std::string filename)=0;
+  virtual long long read(const unsigned char *& data)=0;
+  virtual std::string units() const=0;
+};
+
+class RecordWriter
+{
+public:
+  virtual ~RecordWriter() {}
+  virtual bool open(std::string filename)=0;
+  virtual bool write(const unsigned char *data,size_t num_bytes)=0;
+// only a COS-blocked dataset can mark the end of a file - the other formats run
+// the files together
+  virtual void write_eof() {}
+  virtual bool close()=0;
+  virtual std::string units() const=0;
+};
+
+class CosRecordReader : public RecordReader
+{
+public:
+  bool open(std::string filename) { return istream.open(filename); }
+  long long read(const unsigned char *& data) { return istream.read(data); }
+  std::string units() const { return "COS-blocked records"; }
+
+private:
+  imcstream istream;
+};
+
+// a BufferedRecordReader reads a file that is not COS-blocked in large chunks
+// and keeps the bytes that are still needed in one piece, so that a record can
+// be handed back as a view into the buffer
+const size_t INPUT_BUFFER_BYTES=4194304;
+
+class BufferedRecordReader : public RecordReader
+{
+public:
+  BufferedRecordReader() : fd(-1),buf(INPUT_BUFFER_BYTES),pos(0),len(0),file_size(-1),at_end(false) {}
+  ~BufferedRecordReader()
+  {
+    if (fd > STDIN_FILENO) {
+	close(fd);
+    }
+  }
+  bool open(std::string filename)
+  {
+    fd=(filename == "-") ? STDIN_FILENO : ::open(filename.c_str(),O_RDONLY);
+    if (fd < 0) {
+	return false;
+    }
+    struct stat buf;
+    if (fstat(fd,&buf) == 0 && S_ISREG(buf.st_mode)) {
+	file_size=buf.st_size;
+    }
+    return true;
+  }
+
+protected:
+// fill() makes "num_bytes" bytes available at "pos" and returns false if the
+// file ends first
+  bool fill(size_t num_bytes)
+  {
+    if (len-pos >= num_bytes) {
+	return true;
+    }
+    if (pos > 0) {
+	std::copy(&buf[pos],&buf[len],buf.begin());
+	len-=pos;
+	pos=0;
+    }
+    if (buf.size() < num_bytes) {
+	buf.resize(std::max(num_bytes,buf.size()*2));
+    }
+    while (len < num_bytes && !at_end) {
+	auto n=::read(fd,&buf[len],buf.size()-len);
+	if (n < 0 && errno == EINTR) {
+	  continue;
+	}
+	if (n <= 0) {
+	  at_end=true;
+	}
+	else {
+	  len+=n;
+	}
+    }
+    return (len-pos >= num_bytes);
+  }
+// take() hands back the next "num_bytes" bytes, which fill() has made
+// available
+  const unsigned char *take(size_t num_bytes)
+  {
+    auto data=&buf[pos];
+    pos+=num_bytes;
+    return data;
+  }
+
+  int fd;
+  std::vector<unsigned char> buf;
+  size_t pos,len;
+// the size of a regular file, which bounds the length of a record, and -1 for
+// a pipe
+  unsigned long long file_size;
+  bool at_end;
+};
+
+// plain binary has no record structure, so it is read in records of <recln>
+// bytes (32768 unless given with -B)
+class BinaryRecordReader : public BufferedRecordReader
+{
+public:
+  long long read(const unsigned char *& data)
+  {
+    size_t recln=(args.recln > 0) ? args.recln : 32768;
+    if (!fill(recln)) {
+	if (len == pos) {
+	  return craystream::eod;
+	}
+	recln=len-pos;
+    }
+    data=take(recln);
+    return recln;
+  }
+  std::string units() const { return "Binary records"; }
+};
+
+class TextRecordReader : public BufferedRecordReader
+{
+public:
+  TextRecordReader() : scan(0) {}
+  long long read(const unsigned char *& data)
+  {
+    while (1) {
+	auto eol=reinterpret_cast<const unsigned char *>(memchr(&buf[pos+scan],0xa,len-pos-scan));
+	if (eol != nullptr) {
+	  size_t line_len=eol-&buf[pos];
+	  data=take(line_len+1);
+	  scan=0;
+	  return line_len;
+	}
+	scan=len-pos;
+	if (!fill(scan+1)) {
+// a last line without a newline is also a record
+	  if (scan == 0) {
+	    return craystream::eod;
+	  }
+	  data=take(scan);
+	  auto line_len=scan;
+	  scan=0;
+	  return line_len;
+	}
+    }
+  }
+  std::string units() const { return "UNIX records"; }
+
+private:
+  size_t scan;
+};
+
+// the longest record that an 8-byte marker is taken to hold - it keeps the
+// length of a record and its two markers within a long long
+const unsigned long long MAX_F77_RECORD=0x7fffffffffffffffull-16;
+
+unsigned long long get_marker(const unsigned char *marker,size_t marker_size,bool big_endian)
+{
+  if (big_endian) {
+    return cosblock::unpack(marker,marker_size);
+  }
+  unsigned long long value=0;
+  for (size_t n=marker_size; n > 0; --n) {
+    value=(value << 8) | marker[n-1];
+  }
+  return value;
+}
+
+// f77_layout() finds the marker size and byte order that make the first record
+// in "buf", which holds the start of the file, end with the same marker that
+// starts it - the marker at the end of a record that does not fit in "buf" is
+// read from "fd"; when it can not be read, the marker size of --marker-size and
+// the byte order that gives the shorter record are the best guess
+bool f77_layout(const unsigned char *buf,size_t len,size_t& marker_size,bool& big_endian,int fd = -1)
+{
+  for (auto size : {args.marker_size,12-args.marker_size}) {
+    for (auto order : {true,false}) {
+	if (len < 2*size) {
+	  continue;
+	}
+	auto n=get_marker(buf,size,order);
+	auto matches=false;
+	if (n <= len-2*size) {
+	  matches=(get_marker(&buf[size+n],size,order) == n);
+	}
+	else if (fd >= 0 && n <= MAX_F77_RECORD) {
+	  unsigned char marker[8];
+	  matches=(pread(fd,marker,size,size+n) == static_cast<ssize_t>(size) && get_marker(marker,size,order) == n);
+	}
+	if (matches) {
+	  marker_size=size;
+	  big_endian=order;
+	  return true;
+	}
+    }
+  }
+  marker_size=args.marker_size;
+  big_endian=(len < marker_size || get_marker(buf,marker_size,true) <= get_marker(buf,marker_size,false));
+  return false;
+}
+
+class F77RecordReader : public BufferedRecordReader
+{
+public:
+  F77RecordReader() : marker_size(4),big_endian(true) {}
+  bool open(std::string filename)
+  {
+    if (!BufferedRecordReader::open(filename)) {
+	return false;
+    }
+    fill(buf.size());
+    f77_layout(&buf[pos],len-pos,marker_size,big_endian,fd);
+    return true;
+  }
+  long long read(const unsigned char *& data)
+  {
+    if (!fill(marker_size)) {
+	return (len == pos) ? craystream::eod : bfstream::error;
+    }
+    auto num_bytes=get_marker(&buf[pos],marker_size,big_endian);
+    if (num_bytes > MAX_F77_RECORD || num_bytes+2*marker_size > file_size || !fill(num_bytes+2*marker_size) || get_marker(&buf[pos+marker_size+num_bytes],marker_size,big_endian) != num_bytes) {
+	return bfstream::error;
+    }
+    data=take(num_bytes+2*marker_size)+marker_size;
+    return num_bytes;
+  }
+  std::string units() const { return "F77 records"; }
+
+private:
+  size_t marker_size;
+  bool big_endian;
+};
+
+// a binary rptout block starts with the number of 8-byte words in it
+class RptoutRecordReader : public BufferedRecordReader
+{
+public:
+  long long read(const unsigned char *& data)
+  {
+    if (!fill(8)) {
+	return (len == pos) ? craystream::eod : bfstream::error;
+    }
+    auto num_bytes=cosblock::unpack(&buf[pos+4],4)*8;
+    if (num_bytes < 8 || num_bytes > 8000 || !fill(num_bytes)) {
+	return bfstream::error;
+    }
+    data=take(num_bytes);
+    return num_bytes;
+  }
+  std::string units() const { return "Rptout blocks"; }
+};
+
+// a VBS block starts with a block descriptor word (BDW), which holds the
+// length of the block - in two bytes followed by two zero bytes, or in 31 bits
+// when the first bit is set (a large block)
+size_t vbs_block_length(const unsigned char *bdw)
+{
+  if ((bdw[0] & 0x80) != 0) {
+    return cosblock::unpack(bdw,4) & 0x7fffffff;
+  }
+  return cosblock::unpack(bdw,2);
+}
+
+class VbsBlockReader : public BufferedRecordReader
+{
+public:
+  long long read(const unsigned char *& data)
+  {
+    if (!fill(4)) {
+	return (len == pos) ? craystream::eod : bfstream::error;
+    }
+    auto num_bytes=vbs_block_length(&buf[pos]);
+    if (num_bytes < 4 || !fill(num_bytes)) {
+	return bfstream::error;
+    }
+    data=take(num_bytes);
+    return num_bytes;
   }
-  parse_args(argc,argv);
+  std::string units() const { return "VBS blocks"; }
+};
+
+// a VbsRecordReader takes the segments out of the blocks that "blocks" reads
+// (a binary VBS file, or a COS-blocked one with a block to a record) and puts
+// the spanned records back together - each segment starts with a segment
+// descriptor word (SDW) of a two-byte length, a code and a zero byte, where
+// the code is 0 for a whole record, 1 for the first segment of a record, 3 for
+// a middle one and 2 for the last one; a whole record is handed back as a view
+// into its block, and only a spanned record is copied
+class VbsRecordReader : public RecordReader
+{
+public:
+  VbsRecordReader(RecordReader *block_reader) : blocks(block_reader),block(nullptr),block_len(0),seg_pos(0),record(),in_record(false) {}
+  bool open(std::string filename) { return blocks->open(filename); }
+  long long read(const unsigned char *& data)
+  {
+    while (1) {
+	if (seg_pos == block_len) {
+	  auto status=blocks->read(block);
+	  if (status < 0) {
+	    return (in_record) ? bfstream::error : status;
+	  }
+// a COS-blocked record can run past the end of the block that it holds
+	  if (status < 4 || static_cast<size_t>(status) < vbs_block_length(block)) {
+	    return bfstream::error;
+	  }
+	  block_len=vbs_block_length(block);
+	  seg_pos=4;
+	  continue;
+	}
+	if (seg_pos+4 > block_len) {
+	  return bfstream::error;
+	}
+	auto sdw=&block[seg_pos];
+	size_t seg_len=cosblock::unpack(sdw,2);
+	if (seg_len < 4 || seg_pos+seg_len > block_len) {
+	  return bfstream::error;
+	}
+	auto segment=sdw+4;
+	seg_len-=4;
+	seg_pos+=seg_len+4;
+	switch (sdw[2] & 0x3) {
+	  case 0: {
+	    if (in_record) {
+		return bfstream::error;
+	    }
+	    data=segment;
+	    return seg_len;
+	  }
+	  case 1: {
+	    if (in_record) {
+		return bfstream::error;
+	    }
+	    record.assign(segment,segment+seg_len);
+	    in_record=true;
+	    break;
+	  }
+	  case 3: {
+	    if (!in_record) {
+		return bfstream::error;
+	    }
+	    record.insert(record.end(),segment,segment+seg_len);
+	    break;
+	  }
+	  default: {
+	    if (!in_record) {
+		return bfstream::error;
+	    }
+	    record.insert(record.end(),segment,segment+seg_len);
+	    in_record=false;
+	    data=record.data();
+	    return record.size();
+	  }
+	}
+    }
+  }
+  std::string units() const { return "VBS records"; }
+
+private:
+  std::unique_ptr<RecordReader> blocks;
+  const unsigned char *block;
+  size_t block_len,seg_pos;
+  std::vector<unsigned char> record;
+  bool in_record;
+};
+
+class GribRecordReader : public RecordReader
+{
+public:
+  GribRecordReader() : grid_stream(),buffer(new unsigned char[BUF_LEN]) {}
+  bool open(std::string filename) { return grid_stream.open(filename.c_str()); }
+  long long read(const unsigned char *& data)
+  {
+    auto num_bytes=grid_stream.read(buffer.get(),BUF_LEN);
+    if (num_bytes == bfstream::eof) {
+	return craystream::eod;
+    }
+    data=buffer.get();
+    return num_bytes;
+  }
+  std::string units() const { return "GRIB grids"; }
+
+private:
+  static const size_t BUF_LEN=5000000;
+  InputGRIBStream grid_stream;
+  std::unique_ptr<unsigned char []> buffer;
+};
+
+class CosRecordWriter : public RecordWriter
+{
+public:
+  bool open(std::string filename) { return ostream.open(filename,args.no_cache); }
+  bool write(const unsigned char *data,size_t num_bytes) { return (ostream.write(data,num_bytes) != bfstream::error); }
+  void write_eof() { ostream.write_eof(); }
+  bool close() { return ostream.close(); }
+  std::string units() const { return "COS-blocked records"; }
+
+private:
+  omcstream ostream;
+};
+
+class FileRecordWriter : public RecordWriter
+{
+public:
+  FileRecordWriter() : fp(nullptr) {}
+  ~FileRecordWriter() { close(); }
+  bool open(std::string filename) { return ( (fp=fopen(filename.c_str(),"w")) != nullptr); }
+  bool close()
+  {
+    if (fp == nullptr) {
+	return true;
+    }
+    auto closed=(ferror(fp) == 0);
+    if (fclose(fp) != 0) {
+	closed=false;
+    }
+    fp=nullptr;
+    return closed;
+  }
+
+protected:
+  FILE *fp;
+};
+
+class BinaryRecordWriter : public FileRecordWriter
+{
+public:
+  BinaryRecordWriter(std::string record_units) : FileRecordWriter(),record_units(record_units) {}
+  bool write(const unsigned char *data,size_t num_bytes) { return (fwrite(data,1,num_bytes,fp) == num_bytes); }
+  std::string units() const { return record_units; }
+
+private:
+  std::string record_units;
+};
+
+class TextRecordWriter : public FileRecordWriter
+{
+public:
+  bool write(const unsigned char *data,size_t num_bytes) { return (fwrite(data,1,num_bytes,fp) == num_bytes && fputc('\n',fp) != EOF); }
+  std::string units() const { return "UNIX records"; }
+};
+
+// a VBS block is cut to the length in its block descriptor word
+class VbsBlockWriter : public FileRecordWriter
+{
+public:
+  bool write(const unsigned char *data,size_t num_bytes)
+  {
+    if (num_bytes >= 4) {
+	num_bytes=std::min(num_bytes,vbs_block_length(data));
+    }
+    return (fwrite(data,1,num_bytes,fp) == num_bytes);
+  }
+  std::string units() const { return "VBS blocks"; }
+};
+
+// a VbsRecordWriter packs records into blocks of up to VBS_BLOCK_SIZE bytes
+// for "blocks" to write, and spans a record that does not fit in what is left
+// of a block over as many blocks as it takes
+const size_t VBS_BLOCK_SIZE=32760;
+
+class VbsRecordWriter : public RecordWriter
+{
+public:
+  VbsRecordWriter(RecordWriter *block_writer) : blocks(block_writer),block(VBS_BLOCK_SIZE),block_len(4) {}
+  ~VbsRecordWriter() { close(); }
+  bool open(std::string filename) { return blocks->open(filename); }
+  bool write(const unsigned char *data,size_t num_bytes)
+  {
+    auto first=true;
+    while (1) {
+// a segment needs room for its SDW and at least one byte, unless the record
+// is empty
+	if (block_len+4+((num_bytes > 0) ? 1 : 0) > block.size() && !flush_block()) {
+	  return false;
+	}
+	auto seg_len=std::min(num_bytes,block.size()-block_len-4);
+	auto last=(seg_len == num_bytes);
+	auto sdw=&block[block_len];
+	cosblock::pack(sdw,seg_len+4,2);
+	sdw[2]=(first) ? ((last) ? 0 : 1) : ((last) ? 2 : 3);
+	sdw[3]=0;
+	std::copy(data,data+seg_len,sdw+4);
+	block_len+=seg_len+4;
+	if (last) {
+	  return true;
+	}
+	data+=seg_len;
+	num_bytes-=seg_len;
+	first=false;
+	if (!flush_block()) {
+	  return false;
+	}
+    }
+  }
+  void write_eof()
+  {
+    flush_block();
+    blocks->write_eof();
+  }
+  bool close()
+  {
+    if (blocks == nullptr) {
+	return true;
+    }
+    auto closed=flush_block();
+    if (!blocks->close()) {
+	closed=false;
+    }
+    blocks.reset();
+    return closed;
+  }
+  std::string units() const { return "VBS records"; }
+
+private:
+  bool flush_block()
+  {
+    if (block_len == 4) {
+	return true;
+    }
+    cosblock::pack(block.data(),block_len,2);
+    block[2]=block[3]=0;
+    auto len=block_len;
+    block_len=4;
+    return blocks->write(block.data(),len);
+  }
+
+  std::unique_ptr<RecordWriter> blocks;
+  std::vector<unsigned char> block;
+  size_t block_len;
+};
+
+class F77RecordWriter : public RecordWriter
+{
+public:
+  F77RecordWriter() : writer()
+  {
+    writer.marker_size=args.marker_size;
+    writer.big_endian=args.big_endian;
+  }
+  ~F77RecordWriter() { close(); }
+  bool open(std::string filename) { return ( (writer.fd=::open(filename.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0666)) >= 0); }
+  bool write(const unsigned char *data,size_t num_bytes) { return write_f77_record(writer,data,num_bytes); }
+  bool close()
+  {
+    if (writer.fd < 0) {
+	return true;
+    }
+    auto closed=flush_f77(writer);
+    if (::close(writer.fd) != 0) {
+	closed=false;
+    }
+    writer.fd=-1;
+    return closed;
+  }
+  std::string units() const { return "F77 records"; }
+
+private:
+  F77Writer writer;
+};
+
+// an rptout block is cut to the length in its first 12 bits, as with -r
+class RptoutRecordWriter : public RecordWriter
+{
+public:
+  bool open(std::string filename) { return ostream.open(filename.c_str()); }
+  bool write(const unsigned char *data,size_t num_bytes)
+  {
+    if (num_bytes > 1) {
+	num_bytes=std::min(num_bytes,static_cast<size_t>(cosblock::unpack(data,2) >> 4));
+    }
+    return (ostream.write(data,num_bytes) >= 0);
+  }
+  bool close()
+  {
+    ostream.close();
+    return true;
+  }
+  std::string units() const { return "Rptout blocks"; }
+
+private:
+  orstream ostream;
+};
+
+std::unique_ptr<RecordReader> make_reader(std::string format)
+{
+  if (format == "cos") {
+    return std::unique_ptr<RecordReader>(new CosRecordReader);
+  }
+  else if (format == "f77") {
+    return std::unique_ptr<RecordReader>(new F77RecordReader);
+  }
+  else if (format == "grib") {
+    return std::unique_ptr<RecordReader>(new GribRecordReader);
+  }
+  else if (format == "rptout") {
+    return std::unique_ptr<RecordReader>(new RptoutRecordReader);
+  }
+  else if (format == "text") {
+    return std::unique_ptr<RecordReader>(new TextRecordReader);
+  }
+  else if (format == "vbs") {
+    return std::unique_ptr<RecordReader>(new VbsRecordReader(new VbsBlockReader));
+  }
+  else if (format == "cosvbs") {
+    return std::unique_ptr<RecordReader>(new VbsRecordReader(new CosRecordReader));
+  }
+  else if (format == "vbsblock") {
+    return std::unique_ptr<RecordReader>(new VbsBlockReader);
+  }
+  return std::unique_ptr<RecordReader>(new BinaryRecordReader);
+}
+
+std::unique_ptr<RecordWriter> make_writer(std::string format)
+{
+  if (format == "cos") {
+    return std::unique_ptr<RecordWriter>(new CosRecordWriter);
+  }
+  else if (format == "f77") {
+    return std::unique_ptr<RecordWriter>(new F77RecordWriter);
+  }
+  else if (format == "grib") {
+    return std::unique_ptr<RecordWriter>(new BinaryRecordWriter("GRIB grids"));
+  }
+  else if (format == "rptout") {
+    return std::unique_ptr<RecordWriter>(new RptoutRecordWriter);
+  }
+  else if (format == "text") {
+    return std::unique_ptr<RecordWriter>(new TextRecordWriter);
+  }
+  else if (format == "vbs") {
+    return std::unique_ptr<RecordWriter>(new VbsRecordWriter(new VbsBlockWriter));
+  }
+  else if (format == "cosvbs") {
+    return std::unique_ptr<RecordWriter>(new VbsRecordWriter(new CosRecordWriter));
+  }
+  else if (format == "vbsblock") {
+    return std::unique_ptr<RecordWriter>(new VbsBlockWriter);
+  }
+  return std::unique_ptr<RecordWriter>(new BinaryRecordWriter("Binary records"));
+}
+
+// sniff_format() tells the format of a file from its first block - the checks
+// go from the most to the least particular, and plain binary is what is left
+std::string sniff_format(std::string filename)
+{
+  auto fd=open(filename.c_str(),O_RDONLY);
+  if (fd < 0) {
+    return "";
+  }
+  unsigned char buf[cosblock::block_size];
+  size_t len=0;
+  while (len < cosblock::block_size) {
+    auto n=read(fd,&buf[len],cosblock::block_size-len);
+    if (n < 0 && errno == EINTR) {
+	continue;
+    }
+    if (n <= 0) {
+	break;
+    }
+    len+=n;
+  }
+  size_t marker_size;
+  bool big_endian;
+  auto is_f77=f77_layout(buf,len,marker_size,big_endian,fd);
+  close(fd);
+  if ((len == cosblock::block_size && cosblock::is_first_block(buf)) || (len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b)) {
+    return "cos";
+  }
+  if (len >= 4 && std::string(reinterpret_cast<char *>(buf),4) == "GRIB") {
+    return "grib";
+  }
+  if (is_f77) {
+    return "f77";
+  }
+// a VBS block descriptor word is a length and two zero bytes, and the record
+// descriptor word that follows it is a length, a segment code from 0 to 3 and
+// a zero byte
+  if (len >= 8) {
+    auto block_len=cosblock::unpack(buf,2);
+    auto segment_len=cosblock::unpack(&buf[4],2);
+    if (block_len >= 8 && buf[2] == 0 && buf[3] == 0 && segment_len >= 4 && segment_len <= block_len-4 && buf[6] <= 3 && buf[7] == 0) {
+	return "vbs";
+    }
+  }
+  if (len >= 8 && (buf[0] >> 4) == 1) {
+    auto num_words=cosblock::unpack(&buf[4],4);
+    if (num_words > 0 && num_words <= 1000) {
+	return "rptout";
+    }
+  }
+  auto is_text=(len > 0);
+  for (size_t n=0; n < len && is_text; ++n) {
+    is_text=((buf[n] >= 0x20 && buf[n] < 0x7f) || buf[n] == '\n' || buf[n] == '\t' || buf[n] == '\r' || buf[n] == '\f');
+  }
+  if (is_text) {
+    return "text";
+  }
+  return "binary";
+}
+
+bool convert_records(ConvertJob& job)
+{
+  auto from=args.from;
+  if (from.length() == 0) {
+    if (job.cosfile == "-") {
+	return failed(job,"Error: the format of standard input must be given with --from");
+    }
+    if ( (from=sniff_format(job.cosfile)).length() == 0) {
+	return failed(job,"Error opening "+job.cosfile);
+    }
+  }
+  auto reader=make_reader(from);
+  auto writer=make_writer(args.to);
+  job.read_units=reader->units();
+  job.written_units=writer->units();
+  if (!reader->open(job.cosfile)) {
+    return failed(job,"Error opening "+job.cosfile);
+  }
+  if (job.non_cosfile.length() == 0 && !make_temp_file(job)) {
+    return false;
+  }
+  if (!writer->open(output_path(job))) {
+    return failed(job,"Error opening "+job.non_cosfile);
+  }
+  const unsigned char *data;
+  long long status;
+  while ( (status=reader->read(data)) != craystream::eod) {
+    if (status == bfstream::eof) {
+	writer->write_eof();
+	continue;
+    }
+    if (status < 0) {
+	writer->close();
+	return failed(job,"Error reading "+job.cosfile);
+    }
+    ++job.num_read;
+    if (!writer->write(data,status)) {
+	writer->close();
+	return failed(job,"Error writing "+job.non_cosfile);
+    }
+    ++job.num_written;
+  }
+  if (!writer->close()) {
+    return failed(job,"Error writing "+job.non_cosfile);
+  }
+  if (job.temp_file.length() > 0) {
+    return replace_cosfile(job);
+  }
+  return true;
+}
+
+bool convert_format(ConvertJob& job)
+{
   switch (args.conv) {
     case '6':
     {
-	cos_to_6_bit();
-	break;
+	return cos_to_6_bit(job);
     }
     case 'b':
     {
-	cos_to_binary();
-	break;
+	return cos_to_binary(job);
     }
     case 'B':
     {
-	binary_to_cos();
-	break;
+	return binary_to_cos(job);
     }
     case 'c':
     {
-	cos_to_unix();
-	break;
+	return cos_to_unix(job);
     }
     case 'C':
     {
-	unix_to_cos();
-	break;
+	return unix_to_cos(job);
     }
     case 'f':
     {
-	cos_to_f77();
-	break;
+	return cos_to_f77(job);
     }
     case 'F':
     {
-	f77_to_cos();
-	break;
+	return f77_to_cos(job);
     }
     case 'G':
     {
-	grib_to_cos();
-	break;
+	return grib_to_cos(job);
     }
     case 'r':
     {
-	cos_to_rptout();
-	break;
+	return cos_to_rptout(job);
     }
     case 'R':
     {
-	rptout_to_cos();
-	break;
+	return rptout_to_cos(job);
     }
     case 'v':
     {
-	cos_to_vbs();
-	break;
+	return cos_to_vbs(job);
+    }
+    case 'X':
+    {
+	return convert_records(job);
     }
     default:
     {
-	std::cerr << "Error: conversion flag -" << args.conv << " not supported" << std::endl;
-	exit(1);
+	return failed(job,"Error: conversion flag -"+std::string(1,args.conv)+" not supported");
+    }
+  }
+}
+
+// with --compress, the converted data go through a pipe to a compressor thread
+// on their way to the output file, so that a converted file does not have to
+// be read again to compress it - the thread compresses the data in chunks,
+// several chunks at once when there are threads to spare, and writes each
+// chunk as a gzip member (or zstd frame) of its own, which gunzip (or unzstd)
+// reads back as one stream
+const size_t COMPRESS_CHUNK_BYTES=1048576;
+const size_t MAX_COMPRESS_THREADS=16;
+
+struct CompressChunk {
+  CompressChunk() : in(COMPRESS_CHUNK_BYTES),out(),in_len(0),out_len(0),ok(true) {}
+
+  std::vector<unsigned char> in,out;
+  size_t in_len,out_len;
+  bool ok;
+};
+
+struct Compressor {
+  Compressor() : in_fd(-1),out_fd(-1),num_threads(1),write_failed(false) {}
+
+  int in_fd,out_fd;
+  size_t num_threads;
+  bool write_failed;
+};
+
+extern "C" void *t_compress_chunk(void *c)
+{
+  CompressChunk *chunk=reinterpret_cast<CompressChunk *>(c);
+#ifdef HAVE_ZSTD
+  if (args.compress == "zstd") {
+    chunk->out.resize(ZSTD_compressBound(chunk->in_len));
+    auto len=ZSTD_compress(chunk->out.data(),chunk->out.size(),chunk->in.data(),chunk->in_len,3);
+    chunk->ok=!ZSTD_isError(len);
+    chunk->out_len=(chunk->ok) ? len : 0;
+    return nullptr;
+  }
+#endif
+  z_stream zs;
+  zs.zalloc=Z_NULL;
+  zs.zfree=Z_NULL;
+  zs.opaque=Z_NULL;
+  if (deflateInit2(&zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+    chunk->ok=false;
+    return nullptr;
+  }
+  chunk->out.resize(deflateBound(&zs,chunk->in_len));
+  zs.next_in=chunk->in.data();
+  zs.avail_in=chunk->in_len;
+  zs.next_out=chunk->out.data();
+  zs.avail_out=chunk->out.size();
+  chunk->ok=(deflate(&zs,Z_FINISH) == Z_STREAM_END);
+  chunk->out_len=chunk->out.size()-zs.avail_out;
+  deflateEnd(&zs);
+  return nullptr;
+}
+
+// read_chunk() fills a chunk from the pipe and returns false at the end of the
+// data
+bool read_chunk(int fd,CompressChunk& chunk)
+{
+  chunk.in_len=0;
+  while (chunk.in_len < COMPRESS_CHUNK_BYTES) {
+    auto n=read(fd,&chunk.in[chunk.in_len],COMPRESS_CHUNK_BYTES-chunk.in_len);
+    if (n < 0 && errno == EINTR) {
+	continue;
+    }
+    if (n <= 0) {
+	return false;
+    }
+    chunk.in_len+=n;
+  }
+  return true;
+}
+
+extern "C" void *t_compress(void *c)
+{
+  Compressor *compressor=reinterpret_cast<Compressor *>(c);
+  std::vector<CompressChunk> chunks(compressor->num_threads);
+  std::vector<pthread_t> tids(compressor->num_threads);
+  std::vector<struct iovec> iov(compressor->num_threads);
+  auto more=true;
+  while (more) {
+    size_t num_chunks=0;
+    while (more && num_chunks < chunks.size()) {
+	more=read_chunk(compressor->in_fd,chunks[num_chunks]);
+	if (chunks[num_chunks].in_len > 0) {
+	  ++num_chunks;
+	}
+    }
+// after a failed write, the rest of the data are only drained from the pipe,
+// so that the conversion that is writing to it can finish
+    if (num_chunks == 0 || compressor->write_failed) {
+	continue;
+    }
+    size_t num_started=0;
+    for (size_t n=1; n < num_chunks; ++n) {
+	if (pthread_create(&tids[n],nullptr,t_compress_chunk,&chunks[n]) != 0) {
+	  break;
+	}
+	++num_started;
+    }
+    t_compress_chunk(&chunks[0]);
+    for (size_t n=1; n < num_chunks; ++n) {
+	if (n <= num_started) {
+	  pthread_join(tids[n],nullptr);
+	}
+	else {
+	  t_compress_chunk(&chunks[n]);
+	}
+    }
+    for (size_t n=0; n < num_chunks; ++n) {
+	if (!chunks[n].ok) {
+	  compressor->write_failed=true;
+	}
+	iov[n].iov_base=chunks[n].out.data();
+	iov[n].iov_len=chunks[n].out_len;
+    }
+    if (!compressor->write_failed && !write_all(compressor->out_fd,iov.data(),num_chunks)) {
+	compressor->write_failed=true;
+    }
+  }
+  return nullptr;
+}
+
+// convert_compressed() runs a conversion with its output going to a compressor
+// thread - a temporary file that is to replace the cosfile is not renamed until
+// the compressor has finished with it
+bool convert_compressed(ConvertJob& job)
+{
+  auto removes=removes_cos_blocking(args.conv);
+  std::string temp_file;
+  if (removes && job.non_cosfile.length() == 0) {
+    if (!make_temp_file(job)) {
+	return false;
+    }
+    temp_file=job.temp_file;
+    job.temp_file="";
+  }
+  auto output=(removes) ? job.non_cosfile : job.cosfile;
+  Compressor compressor;
+  compressor.num_threads=spare_threads(MAX_COMPRESS_THREADS);
+  int fds[2];
+  if (output == "-") {
+    compressor.out_fd=STDOUT_FILENO;
+  }
+  else if ( (compressor.out_fd=open(output.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0666)) < 0) {
+    job.temp_file=temp_file;
+    return failed(job,"Error opening "+output);
+  }
+  pthread_t tid;
+  if (pipe(fds) != 0) {
+    fds[0]=fds[1]=-1;
+  }
+  else {
+#ifdef F_SETPIPE_SZ
+    fcntl(fds[1],F_SETPIPE_SZ,COMPRESS_CHUNK_BYTES);
+#endif
+    compressor.in_fd=fds[0];
+    if (pthread_create(&tid,nullptr,t_compress,&compressor) != 0) {
+	close(fds[0]);
+	close(fds[1]);
+	fds[0]=fds[1]=-1;
+    }
+  }
+  if (fds[0] < 0) {
+    if (compressor.out_fd != STDOUT_FILENO) {
+	close(compressor.out_fd);
+	unlink(output.c_str());
+    }
+    return failed(job,"Error starting the compression of "+output);
+  }
+  job.sink="/dev/fd/"+std::to_string(fds[1]);
+  auto converted=convert_format(job);
+  job.sink="";
+  close(fds[1]);
+  pthread_join(tid,nullptr);
+  close(fds[0]);
+  auto closed=(compressor.out_fd == STDOUT_FILENO || close(compressor.out_fd) == 0);
+  if (!converted) {
+    if (output != "-") {
+	unlink(output.c_str());
+    }
+    return false;
+  }
+  job.temp_file=temp_file;
+  if (compressor.write_failed || !closed) {
+    return failed(job,"Error writing "+output);
+  }
+  if (job.temp_file.length() > 0) {
+    return replace_cosfile(job);
+  }
+  return true;
+}
+
+bool convert(ConvertJob& job)
+{
+  if (args.compress.length() > 0) {
+    return convert_compressed(job);
+  }
+  return convert_format(job);
+}
+
+extern "C" void *t_convert(void *q)
+{
+  JobQueue *queue=reinterpret_cast<JobQueue *>(q);
+  while (1) {
+    pthread_mutex_lock(&queue->lock);
+    auto n=queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (n >= queue->jobs.size()) {
+	return nullptr;
+    }
+    convert(queue->jobs[n]);
+  }
+}
+
+// in batch mode, a failed conversion is reported in the summary and the rest
+// of the batch goes on - the exit status is 1 if any conversion failed
+int convert_batch()
+{
+  JobQueue queue;
+  if (args.manifest.length() > 0) {
+    read_manifest(queue.jobs);
+  }
+  for (const auto& file : args.files) {
+    queue.jobs.emplace_back(file,"");
+  }
+  auto num_jobs=std::min(args.num_jobs,queue.jobs.size());
+  std::unique_ptr<pthread_t[]> tids(new pthread_t[num_jobs]);
+  size_t num_started=0;
+  for (; num_started < num_jobs; ++num_started) {
+    if (pthread_create(&tids[num_started],nullptr,t_convert,reinterpret_cast<void *>(&queue)) != 0) {
+	break;
+    }
+  }
+// the threads that did start take the whole queue - with none, the jobs are
+// run here, one at a time
+  if (num_started == 0) {
+    t_convert(&queue);
+  }
+  for (size_t n=0; n < num_started; ++n) {
+    pthread_join(tids[n],nullptr);
+  }
+  size_t width=4;
+  for (const auto& job : queue.jobs) {
+    width=std::max(width,job.cosfile.length());
+  }
+  size_t num_failed=0;
+  std::cout << "\n  " << std::left << std::setw(width) << "File" << std::right << " " << std::setw(10) << "Read" << " " << std::setw(10) << "Written" << "  Status" << std::endl;
+  for (const auto& job : queue.jobs) {
+    std::cout << "  " << std::left << std::setw(width) << job.cosfile << std::right << " " << std::setw(10) << job.num_read << " " << std::setw(10) << job.num_written << "  ";
+    if (job.error.length() > 0) {
+	std::cout << job.error << std::endl;
+	++num_failed;
+    }
+    else if (job.num_bad > 0) {
+	std::cout << "ok, " << job.num_bad << " bad rptout blocks" << std::endl;
+    }
+    else {
+	std::cout << "ok" << std::endl;
+    }
+  }
+  std::cout << "\n  Files converted: " << queue.jobs.size()-num_failed << std::endl;
+  std::cout << "  Files failed: " << num_failed << std::endl;
+  return (num_failed > 0) ? 1 : 0;
+}
+
+int main(int argc,char **argv)
+{
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " [options...] flag cosfile {non-cosfile}" << std::endl;
+    std::cerr << "   or: " << argv[0] << " [options...] -j num [--manifest file] flag cosfile..." << std::endl;
+    std::cerr << "\nfunction: to convert files between COS-blocked and other formats" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "a conversion flag is required (choose one):" << std::endl;
+    std::cerr << "-6 <bits>   convert COS-blocked binary to 6-bit stream, specifying an optional" << std::endl;
+    std::cerr << "              <bits> of 8 to write each 6-bit character in its own 8-bit" << std::endl;
+    std::cerr << "              byte instead of packing them (default is 6)" << std::endl;
+    std::cerr << "-b <recln>  convert COS-blocked binary to plain binary, specifying an optional" << std::endl;
+    std::cerr << "              <recln> to force the record length" << std::endl;
+    std::cerr << "-B <recln>  convert plain binary to COS-blocked binary, specifying an optional" << std::endl;
+    std::cerr << "              <recln> for the binary record length (default is 32768)" << std::endl;
+    std::cerr << "-c          convert COS-blocked ASCII to UNIX ASCII" << std::endl;
+    std::cerr << "-C          convert UNIX ASCII to COS-blocked ASCII" << std::endl;
+    std::cerr << "-f <endian> convert COS-blocked binary to F77 <endian>-endian binary, where" << std::endl;
+    std::cerr << "              <endian> is \"big\" or \"little\"" << std::endl;
+    std::cerr << "-F          convert F77 binary to COS-blocked F77 binary" << std::endl;
+    std::cerr << "-G          convert plain binary GRIB to COS-blocked GRIB" << std::endl;
+    std::cerr << "-r          convert COS-blocked rptout to binary rptout" << std::endl;
+    std::cerr << "-R          convert binary rptout to COS-blocked rptout" << std::endl;
+    std::cerr << "-v          convert COS-blocked IBM VBS to binary IBM VBS" << std::endl;
+    std::cerr << "-X <format> convert the first file, in any of the formats below, to <format> in" << std::endl;
+    std::cerr << "              the second, in one pass - the format of the first file is told" << std::endl;
+    std::cerr << "              from its first block, unless it is given with --from" << std::endl;
+    std::cerr << "              formats: binary (read 32768 bytes to a record), cos, f77, grib," << std::endl;
+    std::cerr << "              rptout, text (one line to a record), vbs (IBM VBS records, which" << std::endl;
+    std::cerr << "              are put back together from their segments and blocked again when" << std::endl;
+    std::cerr << "              written), cosvbs (the same, COS-blocked with a VBS block to a COS" << std::endl;
+    std::cerr << "              record), vbsblock (one VBS block to a record)" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "file name inclusion:" << std::endl;
+    std::cerr << "cosfile: (the name of the COS-blocked file) is always required" << std::endl;
+    std::cerr << "non-cosfile: (the name of the non-COS-blocked file) is:" << std::endl;
+    std::cerr << "  required when ADDING COS-blocking" << std::endl;
+    std::cerr << "  optional when REMOVING COS-blocking (if not included, cosfile will be" << std::endl;
+    std::cerr << "    overwritten)" << std::endl;
+    std::cerr << "either name can be \"-\" for standard input or output - when the COS-blocking" << std::endl;
+    std::cerr << "  is removed from standard input, the non-cosfile defaults to standard output" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "options:" << std::endl;
+    std::cerr << "--sync      when cosfile is overwritten, flush the converted file to disk" << std::endl;
+    std::cerr << "              before it replaces cosfile" << std::endl;
+    std::cerr << "--in-place  with -b and no <recln>, overwrite cosfile in place instead of" << std::endl;
+    std::cerr << "              through a temporary file (faster, but not safe if interrupted)" << std::endl;
+    std::cerr << "--no-cache  write a COS-blocked file around the page cache (O_DIRECT), or drop" << std::endl;
+    std::cerr << "              it from the cache as it is written" << std::endl;
+    std::cerr << "--marker-size num" << std::endl;
+    std::cerr << "            with -f, write \"num\"-byte (4 or 8) F77 record markers (default 4)" << std::endl;
+    std::cerr << "-j num      batch mode: convert \"num\" files at a time (maximum " << MAX_NUM_JOBS << ") and print" << std::endl;
+    std::cerr << "              a summary - each cosfile on the command line is overwritten, and" << std::endl;
+    std::cerr << "              a failed conversion does not stop the others" << std::endl;
+    std::cerr << "--manifest file" << std::endl;
+    std::cerr << "            batch mode: also convert the files listed in \"file\", one" << std::endl;
+    std::cerr << "              \"cosfile {non-cosfile}\" per line" << std::endl;
+#ifdef HAVE_ZSTD
+    std::cerr << "--compress gzip|zstd" << std::endl;
+#else
+    std::cerr << "--compress gzip" << std::endl;
+#endif
+    std::cerr << "            compress the converted file as it is written" << std::endl;
+    std::cerr << "--check report" << std::endl;
+    std::cerr << "            with -r or -R, check the length and checksum of every rptout" << std::endl;
+    std::cerr << "              block, and list the blocks that fail in \"report\" instead of" << std::endl;
+    std::cerr << "              converting them" << std::endl;
+    std::cerr << "--from format" << std::endl;
+    std::cerr << "            with -X, the format of the first file" << std::endl;
+    std::cerr << "\na cosfile that is compressed is decompressed as it is read" << std::endl;
+    exit(1);
+  }
+  parse_args(argc,argv);
+  if (args.check.length() > 0 && (report.fp=fopen(args.check.c_str(),"w")) == nullptr) {
+    std::cerr << "Error opening report " << args.check << std::endl;
+    exit(1);
+  }
+  if (args.batch) {
+    auto status=convert_batch();
+    if (report.fp != nullptr) {
+	fclose(report.fp);
     }
+    return status;
+  }
+  ConvertJob job(args.cosfile,args.non_cosfile);
+  auto converted=convert(job);
+  if (report.fp != nullptr) {
+    fclose(report.fp);
+  }
+  if (!converted) {
+    std::cerr << job.error << std::endl;
+    exit(1);
+  }
+// the summary goes to standard error when the converted data go to standard
+// output
+  auto to_stdout=((removes_cos_blocking(args.conv)) ? job.non_cosfile : job.cosfile) == "-";
+  auto& out=(to_stdout) ? std::cerr : std::cout;
+  out << "\n  " << job.read_units << " read: " << job.num_read << std::endl;
+  out << "  " << job.written_units << " written: " << job.num_written << std::endl;
+  if (args.check.length() > 0) {
+    out << "  Bad rptout blocks: " << job.num_bad << " (listed in " << args.check << ")" << std::endl;
   }
 }
@@ -1,18 +1,37 @@
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <string>
 #include <list>
+#include <map>
+#include <vector>
 #include <regex>
+#include <array>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <bfstream.hpp>
 #include <strutils.hpp>
 #include <utils.hpp>
 #include <myerror.hpp>
+#include "mcstream.hpp"
 
+const size_t MAX_NUM_THREADS=64;
+const size_t DEFAULT_NUM_JOBS=1;
+const size_t MAX_NUM_JOBS=64;
+const size_t NUM_LENGTH_BINS=32;
+const size_t MAX_DISTINCT_LENGTHS=1024;
+enum {TEXT_OUTPUT=0,JSON_OUTPUT,CSV_OUTPUT};
 struct Args {
-  Args() : files(),verbose(false) {}
+  Args() : files(),num_threads(1),num_jobs(DEFAULT_NUM_JOBS),output(TEXT_OUTPUT),verbose(false),build_index(false),profile(false),structure_only(false),aggregate(false) {}
 
   std::list<std::string> files;
-  bool verbose;
+  size_t num_threads,num_jobs;
+  int output;
+  bool verbose,build_index,profile,structure_only,aggregate;
 } args;
 std::string myerror="";
 std::string mywarning="";
@@ -25,6 +44,60 @@ void parse_args(int argc,char **argv)
     if (sp[n] == "-v") {
 	args.verbose=true;
     }
+    else if (sp[n] == "-p") {
+	args.profile=true;
+    }
+    else if (sp[n] == "--index") {
+	args.build_index=true;
+    }
+    else if (sp[n] == "-o") {
+	if (n+1 == sp.size()) {
+	  std::cerr << "Error: -o requires an output format" << std::endl;
+	  exit(1);
+	}
+	if (sp[++n] == "json") {
+	  args.output=JSON_OUTPUT;
+	}
+	else if (sp[n] == "csv") {
+	  args.output=CSV_OUTPUT;
+	}
+	else if (sp[n] != "text") {
+	  std::cerr << "Error: invalid output format " << sp[n] << std::endl;
+	  exit(1);
+	}
+    }
+    else if (sp[n] == "--aggregate") {
+	args.aggregate=true;
+    }
+    else if (sp[n] == "--structure-only") {
+	args.structure_only=true;
+    }
+    else if (sp[n] == "-n") {
+	if (n+1 == sp.size() || !strutils::is_numeric(sp[n+1])) {
+	  std::cerr << "Error: -n requires a number of threads" << std::endl;
+	  exit(1);
+	}
+	args.num_threads=std::stoi(sp[++n]);
+	if (args.num_threads == 0) {
+	  args.num_threads=1;
+	}
+	else if (args.num_threads > MAX_NUM_THREADS) {
+	  args.num_threads=MAX_NUM_THREADS;
+	}
+    }
+    else if (sp[n] == "-j") {
+	if (n+1 == sp.size() || !strutils::is_numeric(sp[n+1])) {
+	  std::cerr << "Error: -j requires a number of jobs" << std::endl;
+	  exit(1);
+	}
+	args.num_jobs=std::stoi(sp[++n]);
+	if (args.num_jobs == 0) {
+	  args.num_jobs=DEFAULT_NUM_JOBS;
+	}
+	else if (args.num_jobs > MAX_NUM_JOBS) {
+	  args.num_jobs=MAX_NUM_JOBS;
+	}
+    }
     else if (std::regex_search(sp[n],std::regex("^-"))) {
 	std::cerr << "Error: invalid flag " << sp[n] << std::endl;
 	exit(1);
@@ -33,126 +106,829 @@ void parse_args(int argc,char **argv)
 	args.files.push_back(sp[n]);
     }
   }
+  if (args.structure_only && args.profile) {
+    std::cerr << "Error: -p can't be used with --structure-only" << std::endl;
+    exit(1);
+  }
+}
+
+// the content counts kept for a record - the byte counts are always kept, the
+// word counts (8-byte words that are not zero) only for a profile
+enum {NON_PRINTABLE=0,PRINTABLE,EBCDIC,WORDS,DPC,CRAY,IEEE,NUM_COUNTS};
+// the statistics for a group of records - a file, a dataset, or all of the
+// datasets; bin 0 of the record lengths counts the empty records and bin n
+// counts the lengths from 2**(n-1) up to 2**n (the last bin also counts all of
+// the longer records), and the counts of the distinct lengths are kept until
+// there are MAX_DISTINCT_LENGTHS of them
+struct Counts {
+  Counts() : recs(0),min(0x7fffffff),max(0),bytes(0),type(),bins(),lengths(),other_lengths(0) {}
+
+  long long recs,min,max,bytes,type[NUM_COUNTS],bins[NUM_LENGTH_BINS];
+  std::map<long long,long long> lengths;
+  long long other_lengths;
+};
+struct Stats {
+  Stats(std::ostream& out_stream) : out(out_stream),dataset(),error(),structured(),eof(),eod(),eof_num(0),last_len(-1),last_written(false) {}
+
+  std::ostream& out;
+  std::string dataset,error,structured;
+  Counts eof,eod;
+  int eof_num;
+  long long last_len;
+  bool last_written;
+};
+struct Aggregate {
+  Aggregate() : counts(),num_datasets(0),num_files(0) {}
+
+  Counts counts;
+  size_t num_datasets;
+  long long num_files;
+};
+struct ScanRecord {
+  ScanRecord() : status(0),type(),is_record(false) {}
+
+  long long status;
+  long long type[NUM_COUNTS];
+  bool is_record;
+};
+struct FileJob {
+  FileJob(std::string file_name) : file(file_name),report(),stats(report),error(),done(false) {}
+
+  std::string file;
+  std::ostringstream report;
+  Stats stats;
+  std::string error;
+  bool done;
+};
+struct JobQueue {
+  JobQueue() : jobs(),next(0),lock(PTHREAD_MUTEX_INITIALIZER),job_done(PTHREAD_COND_INITIALIZER) {}
+
+  std::vector<std::unique_ptr<FileJob>> jobs;
+  size_t next;
+  pthread_mutex_t lock;
+  pthread_cond_t job_done;
+};
+struct ThreadStruct {
+  ThreadStruct() : map(nullptr),map_len(0),first_block(0),end_block(0),tid(),records(),open() {}
+
+  const unsigned char *map;
+  size_t map_len,first_block,end_block;
+  pthread_t tid;
+  std::vector<ScanRecord> records;
+  ScanRecord open;
+};
+
+void add_counts(long long *sum,const long long *type,int sign = 1)
+{
+  for (size_t n=0; n < NUM_COUNTS; ++n) {
+    sum[n]+=sign*type[n];
+  }
+}
+
+// count the printable bytes (0x20-0x7e) in a buffer - a byte is printable when
+// (byte-0x20) is less than 0x5f as an unsigned value, which the vector units
+// test with a signed compare after flipping the sign bit
+long long count_printable(const unsigned char *buf,long long num_bytes)
+{
+  long long n=0,num_printable=0;
+#if defined(__AVX2__)
+  const auto bias32=_mm256_set1_epi8(0x20),flip32=_mm256_set1_epi8(static_cast<char>(0x80)),limit32=_mm256_set1_epi8(static_cast<char>(0x5f^0x80));
+  for (; n+32 <= num_bytes; n+=32) {
+    auto v=_mm256_loadu_si256(reinterpret_cast<const __m256i *>(&buf[n]));
+    v=_mm256_xor_si256(_mm256_sub_epi8(v,bias32),flip32);
+    num_printable+=__builtin_popcount(static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(limit32,v))));
+  }
+#endif
+#if defined(__SSE2__)
+  const auto bias=_mm_set1_epi8(0x20),flip=_mm_set1_epi8(static_cast<char>(0x80)),limit=_mm_set1_epi8(static_cast<char>(0x5f^0x80));
+  for (; n+16 <= num_bytes; n+=16) {
+    auto v=_mm_loadu_si128(reinterpret_cast<const __m128i *>(&buf[n]));
+    v=_mm_xor_si128(_mm_sub_epi8(v,bias),flip);
+    num_printable+=__builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmplt_epi8(v,limit))));
+  }
+#endif
+  for (; n < num_bytes; ++n) {
+    if (buf[n] >= 0x20 && buf[n] <= 0x7e) {
+	++num_printable;
+    }
+  }
+  return num_printable;
+}
+
+// byte classes for a profile: bit 0 is set for printable ASCII, bit 1 for the
+// letters, digits, punctuation and blank of EBCDIC - the two overlap, and a
+// byte in both is counted only as ASCII
+const std::array<unsigned char,256> byte_classes=[] {
+  std::array<unsigned char,256> classes{};
+  for (size_t n=0x20; n <= 0x7e; ++n) {
+    classes[n]|=1;
+  }
+  const size_t ebcdic[][2]={ {0x40,0x40},{0x4a,0x50},{0x5a,0x61},{0x6a,0x6f},{0x79,0x7f},{0x81,0x89},{0x91,0x99},{0xa1,0xa9},{0xc0,0xc9},{0xd0,0xd9},{0xe0,0xe0},{0xe2,0xe9},{0xf0,0xf9} };
+  for (const auto& range : ebcdic) {
+    for (size_t n=range[0]; n <= range[1]; ++n) {
+	classes[n]|=2;
+    }
+  }
+  return classes;
+}();
+
+// a word is likely CDC display code when, at one of the three bit offsets that
+// a continuous stream of 6-bit characters can have in a 64-bit word, all ten
+// characters are letters, digits, blanks or common punctuation (codes 1-47)
+bool is_dpc_word(unsigned long long word)
+{
+  for (size_t offset=0; offset < 6; offset+=2) {
+    size_t n=0;
+    for (; n < 10; ++n) {
+	auto c=(word >> (58-offset-n*6)) & 0x3f;
+	if (c == 0 || c > 47) {
+	  break;
+	}
+    }
+    if (n == 10) {
+	return true;
+    }
+  }
+  return false;
+}
+
+void profile_word(unsigned long long word,long long *type)
+{
+  if (word == 0) {
+    return;
+  }
+  ++type[WORDS];
+// a word of printable ASCII is text, and is not looked at as DPC or as a float,
+// which most such words would pass for
+  auto is_text=true;
+  for (size_t n=0; n < 64 && is_text; n+=8) {
+    is_text=((byte_classes[(word >> n) & 0xff] & 1) != 0);
+  }
+  if (is_text) {
+    return;
+  }
+  if (is_dpc_word(word)) {
+    ++type[DPC];
+  }
+// a normalized Cray float has the top bit of its coefficient set and, for
+// magnitudes between 2**-256 and 2**256, a biased exponent near 040000
+  auto exponent=(word >> 48) & 0x7fff;
+  if ( (word & 0x800000000000ULL) != 0 && exponent >= 0x3f00 && exponent <= 0x4100) {
+    ++type[CRAY];
+  }
+// an IEEE double in the same range of magnitudes
+  else {
+    exponent=(word >> 52) & 0x7ff;
+    if (exponent >= 0x2ff && exponent <= 0x4ff) {
+	++type[IEEE];
+    }
+  }
+}
+
+// build the content profile of a record in a single pass over its bytes - every
+// piece of a record in a COS block, except the last, is a whole number of
+// words, so the pieces can be profiled separately
+void profile(const unsigned char *buf,long long num_bytes,long long *type)
+{
+  long long counts[4]={0,0,0,0};
+  long long n=0;
+  for (; n+static_cast<long long>(cosblock::word_size) <= num_bytes; n+=cosblock::word_size) {
+    unsigned long long word=0;
+    for (size_t m=0; m < cosblock::word_size; ++m) {
+	++counts[byte_classes[buf[n+m]]];
+	word=(word << 8) | buf[n+m];
+    }
+    profile_word(word,type);
+  }
+  for (; n < num_bytes; ++n) {
+    ++counts[byte_classes[buf[n]]];
+  }
+  type[PRINTABLE]+=counts[1]+counts[3];
+  type[NON_PRINTABLE]+=counts[0]+counts[2];
+  type[EBCDIC]+=counts[2];
+}
+
+// count the non-printable and printable bytes in a record, and profile it if
+// requested
+void classify(const unsigned char *buf,long long num_bytes,long long *type)
+{
+  if (args.structure_only) {
+    return;
+  }
+  if (args.profile) {
+    profile(buf,num_bytes,type);
+  }
+  else {
+    auto num_printable=count_printable(buf,num_bytes);
+    type[PRINTABLE]+=num_printable;
+    type[NON_PRINTABLE]+=num_bytes-num_printable;
+  }
+}
+
+long long percent(long long count,long long total)
+{
+  return (total > 0) ? count*100./total : 0;
+}
+
+void add_length(Counts& counts,long long num_bytes,long long num_recs)
+{
+  auto l=counts.lengths.find(num_bytes);
+  if (l != counts.lengths.end()) {
+    l->second+=num_recs;
+  }
+  else if (counts.lengths.size() < MAX_DISTINCT_LENGTHS) {
+    counts.lengths.emplace(num_bytes,num_recs);
+  }
+  else {
+    counts.other_lengths+=num_recs;
+  }
+}
+
+void add_record(Counts& counts,long long num_bytes,const long long *type)
+{
+  ++counts.recs;
+  counts.bytes+=num_bytes;
+  if (counts.recs == 1 || num_bytes < counts.min) counts.min=num_bytes;
+  if (num_bytes > counts.max) counts.max=num_bytes;
+  size_t bin=0;
+  for (auto n=num_bytes; n > 0 && bin < NUM_LENGTH_BINS-1; n>>=1) {
+    ++bin;
+  }
+  ++counts.bins[bin];
+  add_length(counts,num_bytes,1);
+  add_counts(counts.type,type);
+}
+
+void merge_counts(Counts& sum,const Counts& counts)
+{
+  if (counts.recs > 0 && (sum.recs == 0 || counts.min < sum.min)) sum.min=counts.min;
+  sum.recs+=counts.recs;
+  sum.bytes+=counts.bytes;
+  if (counts.max > sum.max) sum.max=counts.max;
+  for (size_t n=0; n < NUM_LENGTH_BINS; ++n) {
+    sum.bins[n]+=counts.bins[n];
+  }
+  for (const auto& length : counts.lengths) {
+    add_length(sum,length.first,length.second);
+  }
+  sum.other_lengths+=counts.other_lengths;
+  add_counts(sum.type,counts.type);
+}
+
+long long average(const Counts& counts)
+{
+  return (counts.recs > 0) ? llround(static_cast<double>(counts.bytes)/counts.recs) : 0;
+}
+
+void print_type(std::ostream& out,const Counts& counts)
+{
+  if (counts.bytes == 0 || args.structure_only) {
+    return;
+  }
+  if (counts.type[NON_PRINTABLE] == 0) {
+    out << "       Type=ASCII" << std::endl;
+  }
+  else if (counts.type[PRINTABLE] == 0) {
+    out << "       Type=Binary" << std::endl;
+  }
+  else {
+    auto binary=percent(counts.type[NON_PRINTABLE],counts.bytes);
+    out << "       Type=Binary or mixed -- Binary= " << binary << "% ASCII= " << 100-binary << "%" << std::endl;
+  }
+  if (args.profile) {
+    out << "       Profile -- EBCDIC= " << percent(counts.type[EBCDIC],counts.bytes) << "% of bytes; DPC= " << percent(counts.type[DPC],counts.type[WORDS]) << "% Cray float= " << percent(counts.type[CRAY],counts.type[WORDS]) << "% IEEE float= " << percent(counts.type[IEEE],counts.type[WORDS]) << "% of " << counts.type[WORDS] << " non-zero words" << std::endl;
+  }
+}
+
+std::string json_string(const std::string& s)
+{
+  std::ostringstream oss;
+  oss << "\"";
+  for (const auto& c : s) {
+    if (c == '"' || c == '\\') {
+	oss << "\\" << c;
+    }
+    else if (static_cast<unsigned char>(c) < 0x20) {
+	oss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec << std::setfill(' ');
+    }
+    else {
+	oss << c;
+    }
+  }
+  oss << "\"";
+  return oss.str();
+}
+
+std::string json_counts(const Counts& counts)
+{
+  std::ostringstream oss;
+  oss << "\"records\":" << counts.recs << ",\"min\":" << ((counts.recs > 0) ? counts.min : 0) << ",\"max\":" << counts.max << ",\"avg\":" << average(counts) << ",\"bytes\":" << counts.bytes;
+  if (!args.structure_only) {
+    auto binary=percent(counts.type[NON_PRINTABLE],counts.bytes);
+    oss << ",\"binary_percent\":" << binary << ",\"ascii_percent\":" << ((counts.bytes > 0) ? 100-binary : 0);
+    if (args.profile) {
+	oss << ",\"ebcdic_percent\":" << percent(counts.type[EBCDIC],counts.bytes) << ",\"dpc_percent\":" << percent(counts.type[DPC],counts.type[WORDS]) << ",\"cray_percent\":" << percent(counts.type[CRAY],counts.type[WORDS]) << ",\"ieee_percent\":" << percent(counts.type[IEEE],counts.type[WORDS]) << ",\"words\":" << counts.type[WORDS];
+    }
+  }
+  oss << ",\"length_bins\":[";
+  for (size_t n=0; n < NUM_LENGTH_BINS; ++n) {
+    if (n > 0) {
+	oss << ",";
+    }
+    oss << counts.bins[n];
+  }
+  oss << "],\"lengths\":{";
+  for (auto l=counts.lengths.begin(); l != counts.lengths.end(); ++l) {
+    if (l != counts.lengths.begin()) {
+	oss << ",";
+    }
+    oss << "\"" << l->first << "\":" << l->second;
+  }
+  oss << "},\"other_lengths\":" << counts.other_lengths;
+  return oss.str();
+}
+
+void print_csv_header(std::ostream& out)
+{
+  out << "dataset,level,file,records,min,max,avg,bytes,binary_percent,ascii_percent,ebcdic_percent,dpc_percent,cray_percent,ieee_percent,words,lengths,other_lengths,bin_0";
+  for (size_t n=1; n < NUM_LENGTH_BINS; ++n) {
+    out << ",bin_" << (1LL << (n-1));
+  }
+  out << std::endl;
+}
+
+std::string csv_row(const std::string& dataset,std::string level,long long file,const Counts& counts)
+{
+  std::ostringstream oss;
+  auto quoted=dataset;
+  strutils::replace_all(quoted,"\"","\"\"");
+  oss << "\"" << quoted << "\"," << level << "," << file << "," << counts.recs << "," << ((counts.recs > 0) ? counts.min : 0) << "," << counts.max << "," << average(counts) << "," << counts.bytes << ",";
+  if (!args.structure_only) {
+    auto binary=percent(counts.type[NON_PRINTABLE],counts.bytes);
+    oss << binary << "," << ((counts.bytes > 0) ? 100-binary : 0);
+  }
+  else {
+    oss << ",";
+  }
+  if (args.profile) {
+    oss << "," << percent(counts.type[EBCDIC],counts.bytes) << "," << percent(counts.type[DPC],counts.type[WORDS]) << "," << percent(counts.type[CRAY],counts.type[WORDS]) << "," << percent(counts.type[IEEE],counts.type[WORDS]) << "," << counts.type[WORDS] << ",";
+  }
+  else {
+    oss << ",,,,,,";
+  }
+  for (auto l=counts.lengths.begin(); l != counts.lengths.end(); ++l) {
+    if (l != counts.lengths.begin()) {
+	oss << " ";
+    }
+    oss << l->first << ":" << l->second;
+  }
+  oss << "," << counts.other_lengths;
+  for (size_t n=0; n < NUM_LENGTH_BINS; ++n) {
+    oss << "," << counts.bins[n];
+  }
+  oss << std::endl;
+  return oss.str();
+}
+
+void add_record(Stats& stats,long long num_bytes,const long long *type)
+{
+  add_record(stats.eof,num_bytes,type);
+  stats.last_written=false;
+  if (args.verbose && args.output == TEXT_OUTPUT && num_bytes != stats.last_len) {
+    if (stats.last_len == -1) {
+	stats.out << "\n     Rec#    Bytes" << std::endl;
+    }
+    stats.out << "  " << std::setw(7) << stats.eof.recs << " " << std::setw(7) << num_bytes << std::endl;
+    stats.last_written=true;
+  }
+  stats.last_len=num_bytes;
+}
+
+void end_file(Stats& stats)
+{
+  ++stats.eof_num;
+  merge_counts(stats.eod,stats.eof);
+// a double EOF (an empty file) has a minimum record length of zero
+  if (stats.eof.recs == 0) {
+    stats.eof.min=0;
+  }
+  switch (args.output) {
+    case JSON_OUTPUT: {
+	if (!stats.structured.empty()) {
+	  stats.structured+=",";
+	}
+	stats.structured+="{\"file\":"+strutils::itos(stats.eof_num)+","+json_counts(stats.eof)+"}";
+	break;
+    }
+    case CSV_OUTPUT: {
+	stats.structured+=csv_row(stats.dataset,"eof",stats.eof_num,stats.eof);
+	break;
+    }
+    default: {
+	if (args.verbose && stats.eof.recs > 0 && !stats.last_written) {
+	  stats.out << "  " << std::setw(7) << stats.eof.recs << " " << std::setw(7) << stats.last_len << std::endl;
+	}
+// summarize for the current file
+	stats.out << "  EOF " << stats.eof_num << ": Recs=" << stats.eof.recs << " Min=" << stats.eof.min << " Max=" << stats.eof.max << " Avg=" << average(stats.eof) << " Bytes=" << stats.eof.bytes << std::endl;
+	print_type(stats.out,stats.eof);
+	stats.out << std::endl;
+    }
+  }
+// reset
+  stats.eof=Counts();
+  stats.last_len=-1;
+}
+
+// returns false when the end of the dataset has been reached
+bool add_status(Stats& stats,const ScanRecord& record)
+{
+  if (record.status >= 0) {
+    add_record(stats,record.status,record.type);
+  }
+  else if (record.status == bfstream::eof) {
+    end_file(stats);
+  }
+  else if (record.status == craystream::eod) {
+// a file that is not closed by an EOF is still summarized
+    if (stats.eof.recs > 0) {
+	end_file(stats);
+    }
+    return false;
+  }
+  else {
+    stats.error="\nRead error on record "+strutils::itos(stats.eof.recs+1)+" - may not be COS-blocked";
+    return false;
+  }
+  return true;
+}
+
+void scan_sequential(imcstream& istream,Stats& stats)
+{
+  ScanRecord record;
+  const unsigned char *buf;
+  do {
+    record=ScanRecord();
+    if (args.structure_only) {
+// only the control words are looked at - a record that crosses a block is not
+// stitched together
+	record.status=istream.ignore();
+    }
+    else if ( (record.status=istream.read(buf)) > 0) {
+	classify(buf,record.status,record.type);
+    }
+  } while (add_status(stats,record));
+}
+
+extern "C" void *t_scan(void *t)
+{
+  ThreadStruct *ts=reinterpret_cast<ThreadStruct *>(t);
+  auto pos=ts->first_block*cosblock::block_size;
+  auto end=ts->end_block*cosblock::block_size;
+  ScanRecord& record=ts->open;
+// every block begins with a BCW, so a thread can start parsing at the first
+// block of its range - the forward index of the BCW covers the part of a record
+// that began in an earlier range
+  if (cosblock::type(cosblock::word(&ts->map[pos])) != cosblock::cw_bcw || (pos == 0 && !cosblock::is_first_block(ts->map))) {
+    record.status=bfstream::error;
+    ts->records.emplace_back(record);
+    return nullptr;
+  }
+  while (1) {
+    auto cw=cosblock::word(&ts->map[pos]);
+    auto block_end=(pos/cosblock::block_size+1)*cosblock::block_size;
+    auto start=pos+cosblock::word_size;
+    pos+=(cosblock::forward_index(cw)+1)*cosblock::word_size;
+    short cw_type;
+    long long piece_len=pos-start;
+    if (pos > block_end) {
+// a forward index that runs past the end of the block - the data can not be
+// looked at
+	record.status=bfstream::error;
+	ts->records.emplace_back(record);
+	return nullptr;
+    }
+    else if (pos < block_end) {
+	auto ncw=cosblock::word(&ts->map[pos]);
+	cw_type=cosblock::type(ncw);
+	piece_len-=cosblock::unused_bits(ncw)/8;
+    }
+    else if (pos == end) {
+// the range ends inside a record, which is finished by the next range
+	classify(&ts->map[start],piece_len,record.type);
+	record.status+=piece_len;
+	return nullptr;
+    }
+    else if (pos+cosblock::block_size > ts->map_len) {
+	cw_type=-1;
+    }
+    else {
+	cw_type=cosblock::type(cosblock::word(&ts->map[pos]));
+	if (cw_type != cosblock::cw_bcw) {
+// an EOF or EOD at the start of a block ends the data of the previous block
+	  piece_len=0;
+	}
+    }
+    if (piece_len > 0) {
+	classify(&ts->map[start],piece_len,record.type);
+    }
+    else if (piece_len < 0) {
+// the unused bytes were at the end of the previous block and have already been
+// counted, and so was the last word of that block, which is no longer whole
+	ScanRecord trimmed;
+	classify(&ts->map[start-cosblock::word_size+piece_len],-piece_len,trimmed.type);
+	if (args.profile) {
+	  profile_word(cosblock::word(&ts->map[start-2*cosblock::word_size]),trimmed.type);
+	}
+	add_counts(record.type,trimmed.type,-1);
+    }
+    record.status+=piece_len;
+    switch (cw_type) {
+	case cosblock::cw_bcw: {
+	  if (pos < block_end) {
+	    record.status=bfstream::error;
+	    ts->records.emplace_back(record);
+	    return nullptr;
+	  }
+	  break;
+	}
+	case cosblock::cw_eor: {
+	  record.is_record=true;
+	  ts->records.emplace_back(record);
+	  record=ScanRecord();
+	  break;
+	}
+	case cosblock::cw_eof: {
+	  record.status=bfstream::eof;
+	  ts->records.emplace_back(record);
+	  record=ScanRecord();
+	  break;
+	}
+	case cosblock::cw_eod: {
+	  record.status=craystream::eod;
+	  ts->records.emplace_back(record);
+	  return nullptr;
+	}
+	default: {
+	  record.status=bfstream::error;
+	  ts->records.emplace_back(record);
+	  return nullptr;
+	}
+    }
+  }
+}
+
+// scan_parallel() splits the dataset into ranges of whole blocks, parses each
+// range in its own thread, and then stitches together the records that cross
+// from one range into the next - a dataset that is read as a stream is scanned
+// in sequence
+void scan_parallel(imcstream& istream,Stats& stats,size_t num_threads)
+{
+  auto num_blocks=istream.mapped_length()/cosblock::block_size;
+  if (num_threads > num_blocks) {
+    num_threads=num_blocks;
+  }
+  if (num_threads < 2 || !istream.is_mapped()) {
+    scan_sequential(istream,stats);
+    return;
+  }
+  std::unique_ptr<ThreadStruct[]> ts(new ThreadStruct[num_threads]);
+  auto blocks_per_thread=(num_blocks+num_threads-1)/num_threads;
+  for (size_t n=0; n < num_threads; ++n) {
+    ts[n].map=istream.mapped_data();
+    ts[n].map_len=istream.mapped_length();
+    ts[n].first_block=n*blocks_per_thread;
+    ts[n].end_block=std::min((n+1)*blocks_per_thread,num_blocks);
+    if (ts[n].first_block >= ts[n].end_block) {
+	num_threads=n;
+	break;
+    }
+    if (pthread_create(&ts[n].tid,nullptr,t_scan,reinterpret_cast<void *>(&ts[n])) != 0) {
+	std::cerr << "Error creating scan thread" << std::endl;
+	exit(1);
+    }
+  }
+  for (size_t n=0; n < num_threads; ++n) {
+    pthread_join(ts[n].tid,nullptr);
+  }
+  ScanRecord carry;
+  for (size_t n=0; n < num_threads; ++n) {
+    if (ts[n].records.empty()) {
+// the whole range is the middle of one record
+	carry.status+=ts[n].open.status;
+	add_counts(carry.type,ts[n].open.type);
+	continue;
+    }
+    auto& first=ts[n].records.front();
+// the length of the part of a record that is in this range can be negative when
+// its unused bytes are at the end of the previous range
+    if (first.is_record) {
+	first.status+=carry.status;
+	add_counts(first.type,carry.type);
+    }
+    for (const auto& record : ts[n].records) {
+	if (!add_status(stats,record)) {
+	  return;
+	}
+    }
+    carry=ts[n].open;
+  }
+// the dataset ended without an EOD
+  ScanRecord record;
+  record.status=bfstream::error;
+  add_status(stats,record);
+}
+
+// process_dataset() writes the report for a dataset to the output stream of
+// "stats" and returns an empty string, or the error that stopped the processing
+std::string process_dataset(const std::string& file,Stats& stats)
+{
+// open the COS-blocked dataset - records are looked at in place in the
+// memory-mapped file, so nothing is copied unless a record crosses a block
+  imcstream istream;
+  if (!istream.open(file.c_str())) {
+    return "Error opening "+file;
+  }
+  stats.dataset=file;
+  if (args.output == TEXT_OUTPUT) {
+    stats.out << "\nProcessing dataset: " << file << std::endl;
+  }
+// read to the end of the COS-blocked dataset
+  if (args.num_threads > 1) {
+    scan_parallel(istream,stats,args.num_threads);
+  }
+  else {
+    scan_sequential(istream,stats);
+  }
+  istream.close();
+  if (!stats.error.empty()) {
+    return stats.error;
+  }
+// summarize for the dataset - the structured output is held until the end, so
+// that nothing is written for a dataset that has an error
+  switch (args.output) {
+    case JSON_OUTPUT: {
+	stats.out << "{\"dataset\":" << json_string(file) << ",\"files\":[" << stats.structured << "],\"eod\":{\"files\":" << stats.eof_num << "," << json_counts(stats.eod) << "}}" << std::endl;
+	break;
+    }
+    case CSV_OUTPUT: {
+	stats.out << stats.structured << csv_row(file,"eod",stats.eof_num,stats.eod);
+	break;
+    }
+    default: {
+	stats.out << "  EOD. Min=" << stats.eod.min << " Max=" << stats.eod.max << " Records=" << stats.eod.recs << " Bytes=" << stats.eod.bytes << std::endl;
+    }
+  }
+  return "";
+}
+
+void add_to_aggregate(Aggregate& aggregate,const Stats& stats)
+{
+  merge_counts(aggregate.counts,stats.eod);
+  ++aggregate.num_datasets;
+  aggregate.num_files+=stats.eof_num;
+}
+
+void print_aggregate(const Aggregate& aggregate)
+{
+  const auto& counts=aggregate.counts;
+  switch (args.output) {
+    case JSON_OUTPUT: {
+	std::cout << "{\"aggregate\":{\"datasets\":" << aggregate.num_datasets << ",\"files\":" << aggregate.num_files << "," << json_counts(counts) << "}}" << std::endl;
+	break;
+    }
+    case CSV_OUTPUT: {
+	std::cout << csv_row("","aggregate",aggregate.num_files,counts);
+	break;
+    }
+    default: {
+	std::cout << "\nAll datasets: Datasets=" << aggregate.num_datasets << " Files=" << aggregate.num_files << std::endl;
+	std::cout << "  Total. Min=" << ((counts.recs > 0) ? counts.min : 0) << " Max=" << counts.max << " Avg=" << average(counts) << " Records=" << counts.recs << " Bytes=" << counts.bytes << std::endl;
+	print_type(std::cout,counts);
+    }
+  }
+}
+
+// each job thread takes the next dataset from the queue until there are none
+// left - the reports are buffered so that they can be printed in order
+extern "C" void *t_process(void *q)
+{
+  JobQueue *queue=reinterpret_cast<JobQueue *>(q);
+  while (1) {
+    pthread_mutex_lock(&queue->lock);
+    auto n=queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (n >= queue->jobs.size()) {
+	return nullptr;
+    }
+    auto& job=*queue->jobs[n];
+    job.error=process_dataset(job.file,job.stats);
+    pthread_mutex_lock(&queue->lock);
+    job.done=true;
+    pthread_cond_broadcast(&queue->job_done);
+    pthread_mutex_unlock(&queue->lock);
+  }
 }
 
 int main(int argc,char **argv)
 {
   if (argc < 2) {
-    std::cerr << "usage: " << argv[0] << " [-v] files" << std::endl;
+    std::cerr << "usage: " << argv[0] << " [-v] [-p] [-n num] [-j num] [-o text|json|csv] [--aggregate] [--structure-only] [--index] files" << std::endl;
     std::cerr << std::endl;
     std::cerr << "function:  " << argv[0] << " provides information about a COS-blocked dataset(s)" << std::endl;
     std::cerr << std::endl;
     std::cerr << "options:" << std::endl;
-    std::cerr << "  -v    provides additional information about the record sizes in the" << std::endl;
-    std::cerr << "        dataset(s)" << std::endl;
+    std::cerr << "  -v       provides additional information about the record sizes in the" << std::endl;
+    std::cerr << "           dataset(s)" << std::endl;
+    std::cerr << "  -p       adds a content profile of each file: the percentage of bytes that" << std::endl;
+    std::cerr << "           are likely EBCDIC text and not printable ASCII, and of words that" << std::endl;
+    std::cerr << "           are not printable ASCII and are likely CDC display code, Cray" << std::endl;
+    std::cerr << "           floating point, or IEEE floating point" << std::endl;
+    std::cerr << "  -n num   scans each dataset with \"num\" threads, each of which parses its" << std::endl;
+    std::cerr << "           own range of blocks (default 1, maximum " << MAX_NUM_THREADS << ")" << std::endl;
+    std::cerr << "  -j num   processes \"num\" datasets at a time - the reports are still" << std::endl;
+    std::cerr << "           printed in the order of the datasets (default " << DEFAULT_NUM_JOBS << ", maximum " << MAX_NUM_JOBS << ")" << std::endl;
+    std::cerr << "  -o fmt   writes the statistics as \"text\" (default), \"json\" (one object per" << std::endl;
+    std::cerr << "           dataset on each line), or \"csv\" (one row per file and per dataset);" << std::endl;
+    std::cerr << "           json and csv include a log2 histogram and the counts of the distinct" << std::endl;
+    std::cerr << "           record lengths (up to " << MAX_DISTINCT_LENGTHS << " of them)" << std::endl;
+    std::cerr << "  --aggregate" << std::endl;
+    std::cerr << "           adds a summary of all of the datasets together" << std::endl;
+    std::cerr << "  --structure-only" << std::endl;
+    std::cerr << "           walks the control words only and reports the record and file" << std::endl;
+    std::cerr << "           layout without the type of data, which never touches the record data" << std::endl;
+    std::cerr << "  --index  instead of reporting, writes a record-boundary index for each" << std::endl;
+    std::cerr << "           dataset to <file>.cosidx, for fast access to its records and files" << std::endl;
     exit(1);
   }
   parse_args(argc,argv);
-  int BUF_LEN=0;
-  std::unique_ptr<unsigned char []> buf;
-  auto eof_recs=0;
-  int eof_min=0x7fffffff,eof_max=0;
-  size_t type[]={0,0};
-  for (const auto& file  : args.files) {
-// open the COS-blocked dataset
-    icstream istream;
-    if (!istream.open(file.c_str())) {
-	std::cerr << "Error opening " << file << std::endl;
-	exit(1);
-    }
-    double eof_bytes=0.;
-    auto eof_num=0;
-    long long eod_bytes=0;
-    auto eod_recs=0;
-    auto eod_min=0x7fffffff;
-    auto eod_max=0;
-    auto last_written=false;
-    std::cout << "\nProcessing dataset: " << file << std::endl;
-// read to the end of the COS-blocked dataset
-    int num_bytes;
-    while ( (num_bytes=istream.peek()) != craystream::eod) {
-	if (num_bytes == bfstream::error) {
-	  std::cerr << "\nRead error on record " << eof_recs+1 << " - may not be COS-blocked" << std::endl;
+  if (args.build_index) {
+    for (const auto& file : args.files) {
+	imcstream istream;
+	if (!istream.open(file)) {
+	  std::cerr << "Error opening " << file << std::endl;
 	  exit(1);
 	}
-	auto last_len=-1;
-// read the current file
-	do {
-	  if (num_bytes > BUF_LEN) {
-	    BUF_LEN=num_bytes;
-	    buf.reset(new unsigned char[BUF_LEN]);
-	  }
-	  istream.read(buf.get(),BUF_LEN);
-// handle a double EOF
-	  if (num_bytes == craystream::eof) {
-	    eof_min=0;
-	    break;
-	  }
-	  ++eof_recs;
-	  ++eod_recs;
-	  eof_bytes+=num_bytes;
-	  eod_bytes+=num_bytes;
-	  if (num_bytes < eof_min) eof_min=num_bytes;
-	  if (num_bytes > eof_max) eof_max=num_bytes;
-	  if (num_bytes < eod_min) eod_min=num_bytes;
-	  if (num_bytes > eod_max) eod_max=num_bytes;
-	  last_written=false;
-	  if (args.verbose && num_bytes != last_len) {
-	    if (last_len == -1) {
-		std::cout << "\n     Rec#    Bytes" << std::endl;
-	    }
-	    std::cout << "  " << std::setw(7) << eof_recs << " " << std::setw(7) << num_bytes << std::endl;
-	    last_written=true;
-	  }
-	  last_len=num_bytes;
-	  for (int n=0; n < num_bytes; ++n) {
-	    if (buf[n] < 0x20 || buf[n] > 0x7e) {
-		++type[0];
-	    }
-	    else {
-		++type[1];
-	    }
-	  }
-	} while ( (num_bytes=istream.peek()) != craystream::eof);
-	num_bytes=istream.read(buf.get(),BUF_LEN);
-	if (args.verbose && eof_recs > 0 && !last_written) {
-	  std::cout << "  " << std::setw(7) << eof_recs << " " << std::setw(7) << last_len << std::endl;
-	}
-// summarize for the current file
-	std::cout << "  EOF " << ++eof_num << ": Recs=" << eof_recs << " Min=" << eof_min << " Max=" << eof_max << " Avg=";
-	if (eof_recs > 0) {
-	  std::cout << lroundf(eof_bytes/eof_recs);
-	}
-	else {
-	  std::cout << "0";
+	if (!istream.build_index(file+".cosidx")) {
+	  std::cerr << "Error building index for " << file << " - may not be COS-blocked" << std::endl;
+	  exit(1);
 	}
-	std::cout << " Bytes=" << static_cast<long long>(eof_bytes) << std::endl;
-	if (eof_bytes > 0) {
-	  if (type[0] == 0) {
-	    std::cout << "       Type=ASCII" << std::endl;
-	  }
-	  else {
-	    if (type[1] == 0) {
-		std::cout << "       Type=Binary" << std::endl;
-	    }
-	    else {
-		type[0]=type[0]*100./eof_bytes;
-		type[1]=100-type[0];
-		std::cout << "       Type=Binary or mixed -- Binary= " << type[0] << "% ASCII= " << type[1] << "%" << std::endl;
-	    }
-	  }
+	istream.close();
+	std::cout << "Index written: " << file << ".cosidx" << std::endl;
+    }
+    return 0;
+  }
+  if (args.output == CSV_OUTPUT) {
+    print_csv_header(std::cout);
+  }
+  Aggregate aggregate;
+  if (args.num_jobs == 1 || args.files.size() < 2) {
+    for (const auto& file : args.files) {
+	Stats stats(std::cout);
+	auto error=process_dataset(file,stats);
+	if (!error.empty()) {
+	  std::cerr << error << std::endl;
+	  exit(1);
 	}
-	std::cout << std::endl;
-// reset
-	eof_bytes=0;
-	eof_recs=0;
-	eof_min=0x7fffffff;
-	eof_max=0;
-	type[0]=type[1]=0;
-    }
-    istream.close();
-// summarize for the dataset
-    std::cout << "  EOD. Min=" << eod_min << " Max=" << eod_max << " Records=" << eod_recs << " Bytes=" << eod_bytes << std::endl;
+	add_to_aggregate(aggregate,stats);
+    }
+    if (args.aggregate) {
+	print_aggregate(aggregate);
+    }
+    return 0;
+  }
+  JobQueue queue;
+  for (const auto& file : args.files) {
+    queue.jobs.emplace_back(new FileJob(file));
+  }
+  auto num_jobs=std::min(args.num_jobs,queue.jobs.size());
+  std::unique_ptr<pthread_t[]> tids(new pthread_t[num_jobs]);
+  for (size_t n=0; n < num_jobs; ++n) {
+    if (pthread_create(&tids[n],nullptr,t_process,reinterpret_cast<void *>(&queue)) != 0) {
+	std::cerr << "Error creating job thread" << std::endl;
+	exit(1);
+    }
+  }
+// print the reports in the order of the datasets on the command line, as each
+// one becomes available
+  for (auto& job : queue.jobs) {
+    pthread_mutex_lock(&queue.lock);
+    while (!job->done) {
+	pthread_cond_wait(&queue.job_done,&queue.lock);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    std::cout << job->report.str() << std::flush;
+    if (!job->error.empty()) {
+	std::cerr << job->error << std::endl;
+	exit(1);
+    }
+    add_to_aggregate(aggregate,job->stats);
+    job.reset();
+  }
+  for (size_t n=0; n < num_jobs; ++n) {
+    pthread_join(tids[n],nullptr);
+  }
+  if (args.aggregate) {
+    print_aggregate(aggregate);
   }
   return 0;
 }
@@ -0,0 +1,236 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <strutils.hpp>
+#include <utils.hpp>
+#include <myerror.hpp>
+#include "mcstream.hpp"
+
+struct Args {
+  Args() : num_records(1000),num_files(1),seed(1),cross_percent(0),text(false),sizes("uniform:1:16384"),cosfile() {}
+
+  size_t num_records,num_files;
+  unsigned long long seed;
+  size_t cross_percent;
+  bool text;
+  std::string sizes,cosfile;
+} args;
+std::string myerror="";
+std::string mywarning="";
+
+// a SizeDistribution draws the record lengths: "fixed:N", "uniform:MIN:MAX" or
+// "exp:MEAN" (exponential - mostly short records, with a long tail)
+struct SizeDistribution {
+  SizeDistribution() : type(),min(0),max(0),mean(0.) {}
+
+  std::string type;
+  size_t min,max;
+  double mean;
+};
+
+// xorshift64* - the same seed always gives the same dataset
+struct Random {
+  Random(unsigned long long seed) : state((seed == 0) ? 0x9e3779b97f4a7c15ULL : seed) {}
+
+  unsigned long long next()
+  {
+    state^=state >> 12;
+    state^=state << 25;
+    state^=state >> 27;
+    return state*0x2545f4914f6cdd1dULL;
+  }
+  size_t between(size_t min,size_t max) { return min+next() % (max-min+1); }
+  double uniform() { return (next() >> 11)*(1./9007199254740992.); }
+
+  unsigned long long state;
+};
+
+const std::string USAGE=" [-n num] [-f num] [-d sizes] [-x percent] [-s seed] [-t] cosfile";
+
+void usage_error(std::string program,std::string message)
+{
+  std::cerr << "Error: " << message << std::endl;
+  std::cerr << "usage: " << program << USAGE << std::endl;
+  exit(1);
+}
+
+// number() checks the value of a numeric option
+unsigned long long number(std::string program,const std::vector<std::string>& sp,size_t& n)
+{
+  auto option=sp[n];
+  if (++n >= sp.size() || !strutils::is_numeric(sp[n]) || sp[n].length() > 19) {
+    usage_error(program,"option "+option+" needs a non-negative number");
+  }
+  return std::stoull(sp[n]);
+}
+
+void parse_args(int argc,char **argv,SizeDistribution& distribution)
+{
+  auto unix_args=unixutils::unix_args_string(argc,argv,'!');
+  auto sp=strutils::split(unix_args,"!");
+  size_t n=0;
+  for (; n < sp.size() && sp[n].length() > 1 && sp[n][0] == '-'; ++n) {
+    if (sp[n] == "-n") {
+	args.num_records=number(argv[0],sp,n);
+    }
+    else if (sp[n] == "-f") {
+	args.num_files=number(argv[0],sp,n);
+	if (args.num_files == 0) {
+	  args.num_files=1;
+	}
+    }
+    else if (sp[n] == "-d") {
+	if (++n == sp.size()) {
+	  usage_error(argv[0],"option -d needs a record size distribution");
+	}
+	args.sizes=sp[n];
+    }
+    else if (sp[n] == "-s") {
+	args.seed=number(argv[0],sp,n);
+    }
+    else if (sp[n] == "-x") {
+	args.cross_percent=number(argv[0],sp,n);
+	if (args.cross_percent > 100) {
+	  args.cross_percent=100;
+	}
+    }
+    else if (sp[n] == "-t") {
+	args.text=true;
+    }
+    else {
+	usage_error(argv[0],"invalid option "+sp[n]);
+    }
+  }
+  if (n+1 != sp.size()) {
+    usage_error(argv[0],(n == sp.size()) ? "no cosfile given" : "only one cosfile can be given");
+  }
+  args.cosfile=sp[n];
+  auto parts=strutils::split(args.sizes,":");
+  distribution.type=parts[0];
+  for (size_t n=1; n < parts.size(); ++n) {
+    if (!strutils::is_numeric(parts[n]) || parts[n].length() > 18) {
+	std::cerr << "Error: invalid record size distribution " << args.sizes << std::endl;
+	exit(1);
+    }
+  }
+  if (distribution.type == "fixed" && parts.size() == 2) {
+    distribution.min=distribution.max=std::stoll(parts[1]);
+  }
+  else if (distribution.type == "uniform" && parts.size() == 3 && std::stoll(parts[1]) <= std::stoll(parts[2])) {
+    distribution.min=std::stoll(parts[1]);
+    distribution.max=std::stoll(parts[2]);
+  }
+  else if (distribution.type == "exp" && parts.size() == 2 && std::stoll(parts[1]) > 0) {
+    distribution.mean=std::stoll(parts[1]);
+  }
+  else {
+    std::cerr << "Error: invalid record size distribution " << args.sizes << std::endl;
+    exit(1);
+  }
+}
+
+size_t record_length(const SizeDistribution& distribution,Random& random)
+{
+  if (distribution.type == "exp") {
+    return std::llround(-distribution.mean*std::log(1.-random.uniform()));
+  }
+  return random.between(distribution.min,distribution.max);
+}
+
+// the data are random bytes, or random printable characters with -t, so that
+// the dataset also converts with cosconvert -c
+void fill_record(std::vector<unsigned char>& record,size_t length,Random& random)
+{
+  if (record.size() < length+8) {
+    record.resize(length+8);
+  }
+  for (size_t n=0; n < length; n+=8) {
+    cosblock::pack(&record[n],random.next(),8);
+  }
+  if (args.text) {
+    for (size_t n=0; n < length; ++n) {
+	record[n]=0x20+record[n] % 95;
+    }
+  }
+}
+
+int main(int argc,char **argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << USAGE << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "function:  " << argv[0] << " writes a synthetic COS-blocked dataset, for testing and" << std::endl;
+    std::cerr << "           benchmarking the COS tools" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "options:" << std::endl;
+    std::cerr << "  -n num   writes \"num\" records to each file (default 1000)" << std::endl;
+    std::cerr << "  -f num   writes \"num\" files, each ended by an EOF (default 1)" << std::endl;
+    std::cerr << "  -d sizes draws the record lengths from \"fixed:N\", \"uniform:MIN:MAX\" or" << std::endl;
+    std::cerr << "           \"exp:MEAN\" (default uniform:1:16384)" << std::endl;
+    std::cerr << "  -x pct   makes \"pct\" percent of the records cross into the next block," << std::endl;
+    std::cerr << "           whatever length the distribution gives them" << std::endl;
+    std::cerr << "  -s seed  seeds the generator - a seed always gives the same dataset" << std::endl;
+    std::cerr << "           (default 1)" << std::endl;
+    std::cerr << "  -t       writes printable text records instead of binary ones" << std::endl;
+    exit(1);
+  }
+  SizeDistribution distribution;
+  parse_args(argc,argv,distribution);
+  omcstream ostream;
+  if (!ostream.open(args.cosfile)) {
+    std::cerr << "Error opening " << args.cosfile << std::endl;
+    exit(1);
+  }
+  Random random(args.seed);
+  std::vector<unsigned char> record;
+  size_t num_bytes=0,num_crossing=0,min_length=0,max_length=0;
+  for (size_t f=0; f < args.num_files; ++f) {
+    for (size_t n=0; n < args.num_records; ++n) {
+	auto length=record_length(distribution,random);
+	if (args.cross_percent > 0 && random.between(1,100) <= args.cross_percent) {
+// a record that starts at the end of a block starts in the next one
+	  auto space=ostream.block_space();
+	  if (space == 0) {
+	    space=cosblock::block_size-cosblock::word_size;
+	  }
+	  length=space+random.between(1,cosblock::block_size);
+	}
+	fill_record(record,length,random);
+// the first byte goes in on its own, so that the block count shows whether the
+// rest of the record goes into another block
+	size_t first_block=0;
+	if (length > 0) {
+	  ostream.write_part(record.data(),1);
+	  first_block=ostream.block_count();
+	  ostream.write_part(&record[1],length-1);
+	  if (ostream.block_count() > first_block) {
+	    ++num_crossing;
+	  }
+	}
+	if (ostream.write(nullptr,0) == bfstream::error) {
+	  std::cerr << "Error writing " << args.cosfile << std::endl;
+	  exit(1);
+	}
+	num_bytes+=length;
+	if ((f == 0 && n == 0) || length < min_length) {
+	  min_length=length;
+	}
+	max_length=std::max(max_length,length);
+    }
+    ostream.write_eof();
+  }
+  if (!ostream.close()) {
+    std::cerr << "Error writing " << args.cosfile << std::endl;
+    exit(1);
+  }
+  auto num_blocks=ostream.block_count();
+  auto num_records=args.num_records*args.num_files;
+  std::cout << "  Files: " << args.num_files << std::endl;
+  std::cout << "  Records: " << num_records << std::endl;
+  std::cout << "  Blocks: " << num_blocks << std::endl;
+  std::cout << "  Data bytes: " << num_bytes << std::endl;
+  std::cout << "  Record length (min/mean/max): " << min_length << "/" << std::fixed << std::setprecision(1) << ((num_records > 0) ? static_cast<double>(num_bytes)/num_records : 0.) << "/" << max_length << std::endl;
+  std::cout << "  Records that cross a block: " << num_crossing << std::endl;
+}
@@ -1,15 +1,24 @@
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <deque>
+#include <vector>
+#include <pthread.h>
 #include <bfstream.hpp>
 #include <strutils.hpp>
 #include <utils.hpp>
 #include <myerror.hpp>
+#include "mcstream.hpp"
 
+const size_t DEFAULT_NUM_JOBS=1;
+const size_t MAX_NUM_JOBS=64;
 struct Args {
-  Args() : maxf(0x7fffffff),prefix(),input_file() {}
+  Args() : maxf(0x7fffffff),num_jobs(DEFAULT_NUM_JOBS),prefix(),input_file(),file_ranges(),block_copy(false),no_cache(false) {}
 
-  size_t maxf;
+  size_t maxf,num_jobs;
   std::string prefix,input_file;
+  std::vector<std::pair<size_t,size_t>> file_ranges;
+  bool block_copy,no_cache;
 } args;
 std::string myerror="";
 std::string mywarning="";
@@ -25,6 +34,44 @@ void parse_args(int argc,char **argv,Args& args)
     else if (sp[n] == "-p") {
 	args.prefix=sp[++n];
     }
+    else if (sp[n] == "-b") {
+	args.block_copy=true;
+    }
+    else if (sp[n] == "--no-cache") {
+	args.no_cache=true;
+    }
+    else if (sp[n] == "--files") {
+// the last argument is the dataset, and not the value of an option
+	if (n+2 == sp.size()) {
+	  std::cerr << "Error: --files requires a list of files" << std::endl;
+	  exit(1);
+	}
+	for (const auto& item : strutils::split(sp[++n],",")) {
+	  auto range=strutils::split(item,"-");
+	  if (range.size() > 2 || !strutils::is_numeric(range.front()) || !strutils::is_numeric(range.back())) {
+	    std::cerr << "Error: invalid file list " << sp[n] << std::endl;
+	    exit(1);
+	  }
+	  args.file_ranges.emplace_back(std::stoi(range.front()),std::stoi(range.back()));
+	  if (args.file_ranges.back().first == 0 || args.file_ranges.back().first > args.file_ranges.back().second) {
+	    std::cerr << "Error: invalid file list " << sp[n] << std::endl;
+	    exit(1);
+	  }
+	}
+    }
+    else if (sp[n] == "-j") {
+	if (n+2 == sp.size() || !strutils::is_numeric(sp[n+1])) {
+	  std::cerr << "Error: -j requires a number of jobs" << std::endl;
+	  exit(1);
+	}
+	args.num_jobs=std::stoi(sp[++n]);
+	if (args.num_jobs == 0) {
+	  args.num_jobs=DEFAULT_NUM_JOBS;
+	}
+	else if (args.num_jobs > MAX_NUM_JOBS) {
+	  args.num_jobs=MAX_NUM_JOBS;
+	}
+    }
     else {
 	std::cerr << "Error: invalid option " << sp[n] << std::endl;
 	exit(1);
@@ -33,27 +80,357 @@ void parse_args(int argc,char **argv,Args& args)
   args.input_file=sp.back();
 }
 
-int main(int argc,char **argv)
+std::string output_name(size_t file_num)
+{
+  auto output_file="f"+strutils::ftos(file_num,3,0,'0');
+  if (args.prefix.length() > 0) {
+    output_file=args.prefix+"."+output_file;
+  }
+  return output_file;
+}
+
+// renumber_block() rewrites the control words of a block that is copied into
+// a new dataset as block "block_num", to what ocstream would have written: the
+// block number of the BCW, the previous-file index of each EOR/EOF and, for
+// the first record of the new dataset, the previous-record index - the walk
+// stops at the control word at offset "end"
+void renumber_block(unsigned char *block,size_t block_num,bool& first_record,size_t end = cosblock::block_size)
+{
+  size_t pos=0;
+  while (pos < end) {
+    auto cw=cosblock::word(&block[pos]);
+    if (pos == 0) {
+	cw=(cw & ~(0xffffffULL << 9)) | (static_cast<unsigned long long>(block_num & 0xffffff) << 9);
+    }
+    else {
+	cw=(cw & ~(0xfffffULL << 24)) | (static_cast<unsigned long long>(block_num & 0xfffff) << 24);
+	if (first_record && cosblock::type(cw) == cosblock::cw_eor) {
+	  cw=(cw & ~(0x7fffULL << 9)) | (static_cast<unsigned long long>(block_num & 0x7fff) << 9);
+	  first_record=false;
+	}
+    }
+    cosblock::pack(&block[pos],cw,cosblock::word_size);
+    pos+=(cosblock::forward_index(cw)+1)*cosblock::word_size;
+  }
+}
+
+// block_copy() writes the blocks of a file that starts on a block boundary to
+// a new dataset without decoding its records - the file ends with the EOF or
+// EOD control word at offset "end_pos", and the last block is closed with an
+// EOF and an EOD, the way that ocstream closes a dataset - the blocks are
+// gathered in a large stream buffer, so that they go out in a few large writes
+bool block_copy(const imcstream& istream,size_t first_block,size_t end_pos,std::string output_file)
+{
+  const size_t BUF_LEN=1024*cosblock::block_size;
+  std::unique_ptr<char[]> obuf(new char[BUF_LEN]);
+  std::ofstream ofs;
+  ofs.rdbuf()->pubsetbuf(obuf.get(),BUF_LEN);
+  ofs.open(output_file.c_str(),std::ios::binary);
+  if (!ofs.is_open()) {
+    std::cerr << "Error opening " << output_file << std::endl;
+    exit(1);
+  }
+  auto map=istream.mapped_data();
+  unsigned char block[cosblock::block_size];
+  auto first_record=true;
+  auto last_block=end_pos/cosblock::block_size;
+  for (size_t n=first_block; n < last_block; ++n) {
+    std::copy(&map[n*cosblock::block_size],&map[(n+1)*cosblock::block_size],block);
+    renumber_block(block,n-first_block,first_record);
+    ofs.write(reinterpret_cast<char *>(block),cosblock::block_size);
+  }
+  auto block_num=last_block-first_block;
+  auto pos=end_pos % cosblock::block_size;
+  std::fill(block,block+cosblock::block_size,0);
+  std::copy(&map[last_block*cosblock::block_size],&map[end_pos],block);
+  renumber_block(block,block_num,first_record,pos);
+  cosblock::pack(&block[pos],(static_cast<unsigned long long>(cosblock::cw_eof) << 60) | (static_cast<unsigned long long>(block_num & 0xfffff) << 24),cosblock::word_size);
+  pos+=cosblock::word_size;
+  if (pos == cosblock::block_size) {
+// the EOF filled the block, so the EOD goes in a new one
+    ofs.write(reinterpret_cast<char *>(block),cosblock::block_size);
+    std::fill(block,block+cosblock::block_size,0);
+    cosblock::pack(block,static_cast<unsigned long long>((block_num+1) & 0xffffff) << 9,cosblock::word_size);
+    pos=cosblock::word_size;
+  }
+  cosblock::pack(&block[pos],static_cast<unsigned long long>(cosblock::cw_eod) << 60,cosblock::word_size);
+  ofs.write(reinterpret_cast<char *>(block),cosblock::block_size);
+  ofs.close();
+  if (ofs.fail()) {
+    return false;
+  }
+  if (args.no_cache) {
+    auto fd=open(output_file.c_str(),O_WRONLY);
+    if (fd >= 0) {
+	drop_cached_pages(fd,0,0);
+	close(fd);
+    }
+  }
+  return true;
+}
+
+// a file of the input dataset, from the control word before its first record
+// (the first BCW or the EOF of the previous file) to the EOF or EOD that ends it
+struct FileRange {
+  FileRange() : file_num(0),start(0),end(0),records_before(0),status(0) {}
+
+  size_t file_num,start,end,records_before;
+  int status;
+};
+struct WriterQueue {
+  WriterQueue() : ranges(),done(false),lock(PTHREAD_MUTEX_INITIALIZER),ready(PTHREAD_COND_INITIALIZER) {}
+
+  std::deque<FileRange> ranges;
+  bool done;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+};
+struct ThreadStruct {
+  ThreadStruct() : tid(),queue(nullptr) {}
+
+  pthread_t tid;
+  WriterQueue *queue;
+};
+
+// next_file() finds the extent of the next file from the control words alone
+// and returns false when there are no more files
+bool next_file(imcstream& istream,FileRange& range)
+{
+  range.start=istream.tell();
+  range.records_before=istream.number_read();
+  long long status;
+  while ( (status=istream.ignore()) >= 0);
+  if (status == bfstream::error) {
+    std::cerr << "Read error on record " << istream.number_read()+1 << " - may not be COS-blocked" << std::endl;
+    exit(1);
+  }
+// nothing follows the last EOF
+  if (status == craystream::eod && istream.number_read() == range.records_before) {
+    return false;
+  }
+  range.end=istream.tell();
+  range.status=status;
+  return true;
+}
+
+// next_selected() returns the first selected file at or after "file_num", or 0
+// if there is none
+size_t next_selected(size_t file_num)
+{
+  if (args.file_ranges.empty()) {
+    return file_num;
+  }
+  size_t next=0;
+  for (const auto& range : args.file_ranges) {
+    if (file_num <= range.second) {
+	auto n=std::max(file_num,range.first);
+	if (next == 0 || n < next) {
+	  next=n;
+	}
+    }
+  }
+  return next;
+}
+
+// skip_files() moves the stream past the files that were not selected, from
+// file "file_num" up to the next selected one - it goes straight there when the
+// dataset has an index and skips over the control words otherwise - and
+// returns false when there are no more files to split
+bool skip_files(imcstream& istream,size_t& file_num)
+{
+  auto next=next_selected(file_num);
+  if (next == 0 || next > args.maxf) {
+    return false;
+  }
+  if (next > file_num && istream.has_index()) {
+    file_num=next;
+    return istream.seek_file(file_num);
+  }
+  for (; file_num < next; ++file_num) {
+    long long status;
+    while ( (status=istream.ignore()) >= 0);
+    if (status == bfstream::error) {
+	std::cerr << "Read error on record " << istream.number_read()+1 << " - may not be COS-blocked" << std::endl;
+	exit(1);
+    }
+    if (status == craystream::eod) {
+	return false;
+    }
+  }
+  return true;
+}
+
+// copy_file() copies the records of the next file piece by piece, so that a
+// record of any length passes through without being held whole - the output
+// is opened only if there is a file to copy, and the status that ended the
+// file (eof or eod) is returned
+int copy_file(imcstream& istream,std::string output_file)
 {
-  icstream istream;
-  ocstream ostream;
-  const size_t BUF_LEN=1000000;
-  unsigned char buffer[BUF_LEN];
+  omcstream ostream;
+  const unsigned char *data;
+  bool end_of_record;
   int num_bytes;
-  std::string output_file;
-  size_t file_num=1;
+  while (1) {
+    num_bytes=istream.read_part(data,end_of_record);
+    if (num_bytes == bfstream::error) {
+	std::cerr << "Read error on record " << istream.number_read()+1 << " - may not be COS-blocked" << std::endl;
+	exit(1);
+    }
+    if (!ostream.is_open()) {
+	if (num_bytes == craystream::eod) {
+	  return num_bytes;
+	}
+	if (!ostream.open(output_file,args.no_cache)) {
+	  std::cerr << "Error opening " << output_file << std::endl;
+	  exit(1);
+	}
+    }
+    if (num_bytes < 0) {
+	break;
+    }
+    if (end_of_record) {
+	if (ostream.write(data,num_bytes) < 0) {
+	  std::cerr << "Write error in " << output_file << " on record " << ostream.number_written() << std::endl;
+	}
+    }
+    else {
+	ostream.write_part(data,num_bytes);
+    }
+  }
+  if (!ostream.close()) {
+    std::cerr << "Write error in " << output_file << std::endl;
+    exit(1);
+  }
+  return num_bytes;
+}
+
+// write_file() copies a file that starts on a block boundary block by block
+// when block copies were requested, and decodes and re-encodes it otherwise -
+// a file starts on a block boundary only when it is the first one in the
+// dataset, or when the EOF of the file before it is the last word of a block
+void write_file(imcstream& istream,const FileRange& range)
+{
+  auto output_file=output_name(range.file_num);
+  if (args.block_copy && (range.start == 0 || (range.start+cosblock::word_size) % cosblock::block_size == 0)) {
+    auto first_block=(range.start == 0) ? 0 : (range.start+cosblock::word_size)/cosblock::block_size;
+    if (!block_copy(istream,first_block,range.end,output_file)) {
+	std::cerr << "Write error in " << output_file << std::endl;
+    }
+    return;
+  }
+  istream.seek(range.start,range.records_before);
+  copy_file(istream,output_file);
+}
+
+// each writer thread has its own stream on the input dataset and writes the
+// files that the reader hands to it until the reader is done
+extern "C" void *t_write(void *t)
+{
+  ThreadStruct *ts=reinterpret_cast<ThreadStruct *>(t);
+  auto queue=ts->queue;
+  imcstream istream;
+  if (!istream.open(args.input_file)) {
+    std::cerr << "Error opening " << args.input_file << std::endl;
+    exit(1);
+  }
+  while (1) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->ranges.empty() && !queue->done) {
+	pthread_cond_wait(&queue->ready,&queue->lock);
+    }
+    if (queue->ranges.empty()) {
+	pthread_mutex_unlock(&queue->lock);
+	return nullptr;
+    }
+    auto range=queue->ranges.front();
+    queue->ranges.pop_front();
+    pthread_mutex_unlock(&queue->lock);
+    write_file(istream,range);
+  }
+}
 
+// split_dataset() finds the files in the input dataset by their control words
+// and writes each one either right away or, with more than one job, in a pool
+// of writer threads
+void split_dataset()
+{
+  imcstream istream,writer_stream;
+  if (!istream.open(args.input_file) || (args.num_jobs == 1 && !writer_stream.open(args.input_file))) {
+    std::cerr << "Error opening " << args.input_file << std::endl;
+    exit(1);
+  }
+  WriterQueue queue;
+  std::unique_ptr<ThreadStruct[]> ts(new ThreadStruct[args.num_jobs]);
+  if (args.num_jobs > 1) {
+    for (size_t n=0; n < args.num_jobs; ++n) {
+	ts[n].queue=&queue;
+	if (pthread_create(&ts[n].tid,nullptr,t_write,reinterpret_cast<void *>(&ts[n])) != 0) {
+	  std::cerr << "Error creating writer thread" << std::endl;
+	  exit(1);
+	}
+    }
+  }
+  if (!args.file_ranges.empty()) {
+    istream.load_index(args.input_file+".cosidx");
+  }
+  FileRange range;
+  for (range.file_num=1; skip_files(istream,range.file_num) && next_file(istream,range); ++range.file_num) {
+    if (args.num_jobs > 1) {
+	pthread_mutex_lock(&queue.lock);
+	queue.ranges.emplace_back(range);
+	pthread_cond_signal(&queue.ready);
+	pthread_mutex_unlock(&queue.lock);
+    }
+    else {
+	write_file(writer_stream,range);
+    }
+// an EOD without an EOF ends the last file
+    if (range.status == craystream::eod) {
+	break;
+    }
+  }
+  if (args.num_jobs > 1) {
+    pthread_mutex_lock(&queue.lock);
+    queue.done=true;
+    pthread_cond_broadcast(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+    for (size_t n=0; n < args.num_jobs; ++n) {
+	pthread_join(ts[n].tid,nullptr);
+    }
+  }
+}
+
+int main(int argc,char **argv)
+{
   if (argc < 2) {
-    std::cerr << "usage: " << argv[0] << " [-m maxFiles] [-p prefix] file" << std::endl;
+    std::cerr << "usage: " << argv[0] << " [-m maxFiles] [--files list] [-p prefix] [-b] [--no-cache] [-j jobs] file" << std::endl;
     std::cerr << "\nfunction:  " << argv[0] << " splits multiple-file COS-blocked datasets into single-file" << std::endl;
     std::cerr << "           COS-blocked files" << std::endl;
     std::cerr << "\noptions:" << std::endl;
     std::cerr << "  -m maxFiles  specifies the maximum number of files to split, where \"maxf\" is" << std::endl;
     std::cerr << "               an integer - if \"maxf\" is omitted, all files will be split" << std::endl;
     std::cerr << std::endl;
+    std::cerr << "  --files list splits only the files in \"list\", a comma-separated list of" << std::endl;
+    std::cerr << "               file numbers and ranges, e.g. 17,40-55,200 - the other files are" << std::endl;
+    std::cerr << "               skipped over by their control words, or by the record index" << std::endl;
+    std::cerr << "               \"file.cosidx\" (see cosfile --index) if there is one" << std::endl;
+    std::cerr << std::endl;
     std::cerr << "  -p prefix    specifies the prefix for the single-file COS-blocked datasets -" << std::endl;
     std::cerr << "               if specified, the file names will have the form prefix.f00[n]," << std::endl;
     std::cerr << "               where n is an integer, starting with 1" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "  -b           copies a file block by block, rewriting only the control" << std::endl;
+    std::cerr << "               words, when it starts on a block boundary in the dataset (always" << std::endl;
+    std::cerr << "               true of the first file) - other files are re-blocked record by" << std::endl;
+    std::cerr << "               record" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "  --no-cache   writes the files around the page cache (O_DIRECT), or drops" << std::endl;
+    std::cerr << "               them from it as they are written, so that splitting a very" << std::endl;
+    std::cerr << "               large dataset does not push other files out of the cache" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "  -j jobs      writes up to \"jobs\" files at the same time (default " << DEFAULT_NUM_JOBS << "," << std::endl;
+    std::cerr << "               maximum " << MAX_NUM_JOBS << ") - the files are found from the control words" << std::endl;
+    std::cerr << "               and handed to a pool of writers" << std::endl;
     std::cerr << "\nexamples:" << std::endl;
     std::cerr << "  cossplit mydataset" << std::endl;
     std::cerr << "     splits the multiple-file COS-blocked dataset \"mydataset\" into single" << std::endl;
@@ -63,35 +440,30 @@ int main(int argc,char **argv)
     std::cerr << "     splits only the first 5 files from \"mydataset\" into files f001 through" << std::endl;
     std::cerr << "     f005" << std::endl;
     std::cerr << std::endl;
+    std::cerr << "  cossplit --files 2,5-7 mydataset" << std::endl;
+    std::cerr << "     splits only files 2, 5, 6 and 7 from \"mydataset\" into files f002, f005," << std::endl;
+    std::cerr << "     f006 and f007" << std::endl;
+    std::cerr << std::endl;
     std::cerr << "  cossplit -p myprefix mydataset" << std::endl;
     std::cerr << "     splits \"mydataset\" into single files with names of the form" << std::endl;
     std::cerr << "     \"myprefix.f00[n]\"" << std::endl;
     exit(1);
   }
   parse_args(argc,argv,args);
-  if (!istream.open(args.input_file.c_str())) {
+  imcstream istream;
+  if (!istream.open(args.input_file)) {
     std::cerr << "Error opening " << args.input_file << std::endl;
     exit(1);
   }
-  while (file_num <= args.maxf && (num_bytes=istream.read(buffer,BUF_LEN)) != craystream::eod) {
-    if (!ostream.is_open()) {
-	output_file="f"+strutils::ftos(file_num,3,0,'0');
-	if (args.prefix.length() > 0) {
-	  output_file=args.prefix+"."+output_file;
-	}
-	if (!ostream.open(output_file.c_str())) {
-	  std::cerr << "Error opening " << output_file << std::endl;
-	  exit(1);
-	}
-    }
-    if (num_bytes == craystream::eof) {
-	ostream.close();
-	file_num++;
-    }
-    else {
-	if (ostream.write(buffer,num_bytes) < 0) {
-	  std::cerr << "Write error in " << output_file << " on record " << ostream.number_written()+1 << std::endl;
-	}
-    }
+// block copies and the writer pool need the mapping of the dataset - one that
+// is read as a stream (a pipe, or a compressed file) is split in sequence
+  if ((args.block_copy || args.num_jobs > 1) && istream.is_mapped()) {
+    istream.close();
+    split_dataset();
+    return 0;
+  }
+  if (!args.file_ranges.empty()) {
+    istream.load_index(args.input_file+".cosidx");
   }
+  for (size_t file_num=1; skip_files(istream,file_num) && copy_file(istream,output_name(file_num)) == bfstream::eof; ++file_num);
 }
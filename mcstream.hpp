@@ -0,0 +1,1143 @@
+#ifndef MCSTREAM_H
+#define MCSTREAM_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include <bfstream.hpp>
+
+// control word layout of a COS-blocked dataset - every control word is a
+// 64-bit big-endian Cray word and every block is 4096 bytes long, beginning
+// with a block control word (BCW)
+namespace cosblock {
+
+const size_t block_size=4096;
+const size_t word_size=8;
+const short cw_bcw=0;
+const short cw_eor=0x8;
+const short cw_eof=0xe;
+const short cw_eod=0xf;
+
+inline unsigned long long unpack(const unsigned char *buf,size_t num_bytes)
+{
+  unsigned long long value=0;
+  for (size_t n=0; n < num_bytes; ++n) {
+    value=(value << 8) | buf[n];
+  }
+  return value;
+}
+
+inline void pack(unsigned char *buf,unsigned long long value,size_t num_bytes)
+{
+  for (size_t n=num_bytes; n > 0; --n) {
+    buf[n-1]=value & 0xff;
+    value>>=8;
+  }
+}
+
+inline unsigned long long word(const unsigned char *buf)
+{
+  return unpack(buf,word_size);
+}
+
+inline short type(unsigned long long cw)
+{
+  return cw >> 60;
+}
+
+// number of Cray words of data that follow the control word
+inline size_t forward_index(unsigned long long cw)
+{
+  return cw & 0x1ff;
+}
+
+// number of unused bits at the end of the data that precede an EOR/EOF
+inline size_t unused_bits(unsigned long long cw)
+{
+  return (cw >> 54) & 0x3f;
+}
+
+// block number of a BCW
+inline size_t block_number(unsigned long long cw)
+{
+  return (cw >> 9) & 0xffffff;
+}
+
+// a valid first block has a BCW with block number 0 and no bits set in the
+// unused fields
+inline bool is_first_block(const unsigned char *buf)
+{
+  auto cw=word(buf);
+  return (type(cw) == cw_bcw && ((cw >> 53) & 0x7f) == 0 && ((cw >> 33) & 0x7ffff) == 0 && block_number(cw) == 0);
+}
+
+// a record-boundary index (.cosidx) is a 48-byte header (magic, number of
+// records, number of files, size of the dataset, and the seconds and
+// nanoseconds of its modification time), followed by a 24-byte entry for each
+// record (offset of the control word that starts it, length, file number,
+// block number and four reserved bytes) and a 16-byte entry for each file
+// (offset of the control word that starts it and the number of records that
+// precede it) - all values are big-endian
+const std::string index_magic="COSIDX02";
+const size_t index_header_size=48;
+const size_t index_record_size=24;
+const size_t index_file_size=16;
+
+} // end namespace cosblock
+
+// drop_cached_pages() writes out the pages of a range of an output file and
+// takes them out of the page cache, so that writing a very large dataset does
+// not push everything else out of the cache
+inline void drop_cached_pages(int fd,off_t offset,off_t length)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+  sync_file_range(fd,offset,length,SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+  fdatasync(fd);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd,offset,length,POSIX_FADV_DONTNEED);
+#endif
+}
+
+// imcstream reads a COS-blocked dataset through a memory mapping of the file
+// and hands back each record as a view into the mapping. A record is copied
+// only when it crosses a Cray block, in which case its pieces are stitched
+// together in an internal buffer. A view stays valid until the next call that
+// moves the stream. Return values are the same as those of icstream, except
+// that the length of a record is a long long, as a record can be longer than
+// 2 GB.
+//
+// A dataset that can not be mapped - standard input, opened as "-", or any
+// other pipe - is read strictly in sequence into a window that holds only the
+// blocks that are still needed. Such a stream can not be rewound once it has
+// been read from, or be positioned with seek() or an index, and a peek() must
+// be followed by the read() or ignore() of the same record. A dataset that is
+// compressed with gzip (or with zstd, when built with HAVE_ZSTD) is read the
+// same way, and is decompressed as it is read.
+class imcstream
+{
+public:
+  imcstream() : file_name(),fd(-1),map(nullptr),map_len(0),mtime(),cw_pos(0),cw_type(cosblock::cw_bcw),num_read(0),in_record(false),rec_buf(nullptr),rec_buf_len(0),next(),index(),stream() {}
+  imcstream(std::string filename) : imcstream() { open(filename); }
+  imcstream(const imcstream& source) = delete;
+  ~imcstream() { close(); }
+  imcstream& operator=(const imcstream& source) = delete;
+  size_t block_count() const { return (map_len > 0) ? cw_pos/cosblock::block_size+1 : 0; }
+// build_index() walks the control words of the whole dataset and writes the
+// offset, length, file number and block number of every record to a sidecar
+// index, so that seek_record() and seek_file() can later go straight to them
+  bool build_index(std::string index_name)
+  {
+    if (stream.on) {
+	return false;
+    }
+    std::vector<unsigned char> records,files;
+    unsigned char entry[cosblock::index_record_size];
+    size_t num_files=1,num_records=0;
+    std::fill(entry,entry+cosblock::index_record_size,0);
+    files.insert(files.end(),entry,entry+cosblock::index_file_size);
+    rewind();
+    long long status;
+    while (1) {
+	auto pos=cw_pos;
+	if ( (status=ignore()) < 0) {
+	  if (status != bfstream::eof) {
+	    break;
+	  }
+	  ++num_files;
+	  cosblock::pack(entry,cw_pos,8);
+	  cosblock::pack(&entry[8],num_read,8);
+	  files.insert(files.end(),entry,entry+cosblock::index_file_size);
+	}
+	else {
+	  ++num_records;
+	  cosblock::pack(entry,pos,8);
+	  cosblock::pack(&entry[8],status,4);
+	  cosblock::pack(&entry[12],num_files,4);
+	  cosblock::pack(&entry[16],pos/cosblock::block_size,4);
+	  cosblock::pack(&entry[20],0,4);
+	  records.insert(records.end(),entry,entry+cosblock::index_record_size);
+	}
+    }
+    rewind();
+    if (status != craystream::eod) {
+	return false;
+    }
+// an EOF that is followed directly by the EOD does not start another file
+    if (num_files > 1 && cosblock::unpack(&files[files.size()-8],8) == num_records) {
+	--num_files;
+	files.resize(files.size()-cosblock::index_file_size);
+    }
+    std::ofstream ofs(index_name.c_str(),std::ios::binary);
+    if (!ofs.is_open()) {
+	return false;
+    }
+    unsigned char header[cosblock::index_header_size];
+    std::copy(cosblock::index_magic.begin(),cosblock::index_magic.end(),header);
+    cosblock::pack(&header[8],num_records,8);
+    cosblock::pack(&header[16],num_files,8);
+    cosblock::pack(&header[24],map_len,8);
+    cosblock::pack(&header[32],mtime.tv_sec,8);
+    cosblock::pack(&header[40],mtime.tv_nsec,8);
+    ofs.write(reinterpret_cast<char *>(header),cosblock::index_header_size);
+    ofs.write(reinterpret_cast<char *>(records.data()),records.size());
+    ofs.write(reinterpret_cast<char *>(files.data()),files.size());
+    ofs.close();
+    return ofs.good();
+  }
+  void close()
+  {
+    if (!is_open()) {
+	return;
+    }
+    unload_index();
+    if (map != nullptr) {
+	munmap(const_cast<unsigned char *>(map),map_len);
+	map=nullptr;
+    }
+    if (fd != STDIN_FILENO) {
+	::close(fd);
+    }
+    fd=-1;
+    map_len=0;
+    mtime=timespec();
+    close_source();
+    stream=Stream();
+    file_name="";
+  }
+  long long ignore()
+  {
+    if (next.cached) {
+	return take_next(nullptr);
+    }
+    return next_record(nullptr);
+  }
+  bool has_index() const { return (index.map != nullptr); }
+// is_mapped() is false for a dataset that is read as a stream - mapped_data()
+// and mapped_length() then describe only the current window of blocks
+  bool is_mapped() const { return (map != nullptr); }
+  bool is_open() const { return (fd >= 0); }
+// is_stream() is true for a dataset that is read in sequence - from a pipe, or
+// decompressed as it is read - and so is not the file that holds its bytes
+  bool is_stream() const { return stream.on; }
+// load_index() attaches an index written by build_index() - it is rejected if
+// it does not match the size and the modification time of the open dataset,
+// as a dataset that has been written again can have the same size and a
+// different layout
+  bool load_index(std::string index_name)
+  {
+    unload_index();
+    if (stream.on) {
+	return false;
+    }
+    auto ifd=::open(index_name.c_str(),O_RDONLY);
+    if (ifd < 0) {
+	return false;
+    }
+    struct stat buf;
+    if (fstat(ifd,&buf) != 0 || static_cast<size_t>(buf.st_size) < cosblock::index_header_size) {
+	::close(ifd);
+	return false;
+    }
+    auto m=mmap(nullptr,buf.st_size,PROT_READ,MAP_PRIVATE,ifd,0);
+    ::close(ifd);
+    if (m == MAP_FAILED) {
+	return false;
+    }
+    index.map=reinterpret_cast<const unsigned char *>(m);
+    index.map_len=buf.st_size;
+    index.num_records=cosblock::unpack(&index.map[8],8);
+    index.num_files=cosblock::unpack(&index.map[16],8);
+    if (std::string(reinterpret_cast<const char *>(index.map),8) != cosblock::index_magic || cosblock::unpack(&index.map[24],8) != map_len || cosblock::unpack(&index.map[32],8) != static_cast<unsigned long long>(mtime.tv_sec) || cosblock::unpack(&index.map[40],8) != static_cast<unsigned long long>(mtime.tv_nsec) || index.map_len != cosblock::index_header_size+index.num_records*cosblock::index_record_size+index.num_files*cosblock::index_file_size) {
+	unload_index();
+	return false;
+    }
+    return true;
+  }
+// the mapped dataset, for code that walks the blocks itself
+  const unsigned char *mapped_data() const { return map; }
+  size_t mapped_length() const { return map_len; }
+  size_t number_read() const { return num_read; }
+  bool open(std::string filename)
+  {
+// opening a stream while another is open is a fatal error
+    if (is_open()) {
+	std::cerr << "Error: an open stream already exists" << std::endl;
+	exit(1);
+    }
+    if (filename == "-") {
+	fd=STDIN_FILENO;
+    }
+    else if ( (fd=::open(filename.c_str(),O_RDONLY)) < 0) {
+	return false;
+    }
+    struct stat buf;
+    if (fstat(fd,&buf) != 0) {
+	if (fd != STDIN_FILENO) {
+	  ::close(fd);
+	}
+	fd=-1;
+	return false;
+    }
+    if (!S_ISREG(buf.st_mode) || is_compressed()) {
+	if (!open_source()) {
+	  if (fd != STDIN_FILENO) {
+	    ::close(fd);
+	  }
+	  fd=-1;
+	  close_source();
+	  stream=Stream();
+	  return false;
+	}
+    }
+    else {
+	map_len=buf.st_size;
+	mtime=buf.st_mtim;
+    }
+    if (map_len > 0) {
+	auto m=mmap(nullptr,map_len,PROT_READ,MAP_PRIVATE,fd,0);
+	if (m == MAP_FAILED) {
+	  ::close(fd);
+	  fd=-1;
+	  map_len=0;
+	  return false;
+	}
+	map=reinterpret_cast<const unsigned char *>(m);
+	madvise(m,map_len,MADV_SEQUENTIAL);
+    }
+    file_name=filename;
+    rewind();
+    return true;
+  }
+// peek() parses the next record from the control words and keeps the result,
+// so that the read() or ignore() that follows does not have to parse it again
+  long long peek()
+  {
+    if (!next.cached) {
+	auto pos=cw_pos;
+	auto cwt=cw_type;
+	auto nr=num_read;
+	next.data=nullptr;
+	next.status=next_record(&next.data);
+	next.cw_pos=cw_pos;
+	next.cw_type=cw_type;
+	next.num_read=num_read;
+	next.cached=true;
+	cw_pos=pos;
+	cw_type=cwt;
+	num_read=nr;
+    }
+    return next.status;
+  }
+  long long read(const unsigned char *& data)
+  {
+    if (next.cached) {
+	return take_next(&data);
+    }
+    return next_record(&data);
+  }
+// read_part() returns the next piece of a record - the part of it that is in
+// one block - as a view into the mapping, and sets "end_of_record" on the last
+// piece, so that a record of any length can be passed along without stitching
+// it together; it returns eof or eod in place of a record, like read(), and
+// must not be mixed with read() in the middle of a record
+  int read_part(const unsigned char *& data,bool& end_of_record)
+  {
+    if (next.cached) {
+	next.cached=false;
+    }
+    end_of_record=false;
+    if (!in_record) {
+	switch (cw_type) {
+	  case cosblock::cw_bcw:
+	  case cosblock::cw_eor:
+	  case cosblock::cw_eof: {
+	    break;
+	  }
+	  case cosblock::cw_eod: {
+	    return craystream::eod;
+	  }
+	  default: {
+	    return bfstream::error;
+	  }
+	}
+    }
+    while (1) {
+	auto cw=cosblock::word(at(cw_pos));
+	auto block_end=(cw_pos/cosblock::block_size+1)*cosblock::block_size;
+	auto start=cw_pos+cosblock::word_size;
+	stream.keep=cw_pos;
+	fill_window(block_end+cosblock::block_size);
+	cw_pos+=(cosblock::forward_index(cw)+1)*cosblock::word_size;
+	if (cw_pos > block_end || (cw_pos == block_end && cw_pos+cosblock::block_size > map_len)) {
+	  cw_type=-1;
+	  in_record=false;
+	  return bfstream::error;
+	}
+	auto ncw=cosblock::word(at(cw_pos));
+	cw_type=cosblock::type(ncw);
+	long long piece_len=cw_pos-start;
+	if (cw_pos < block_end) {
+// a piece that would be negative has already been trimmed from the end of the
+// previous one
+	  piece_len-=cosblock::unused_bits(ncw)/8;
+	  if (piece_len < 0) {
+	    piece_len=0;
+	  }
+	}
+	else if (cw_type == cosblock::cw_bcw) {
+// the unused bits of an EOR that directly follows the next BCW apply to the end
+// of this piece
+	  auto nncw=cosblock::word(at(cw_pos+cosblock::word_size));
+	  if (cosblock::forward_index(ncw) == 0 && (cosblock::type(nncw) == cosblock::cw_eor || cosblock::type(nncw) == cosblock::cw_eof)) {
+	    piece_len-=cosblock::unused_bits(nncw)/8;
+	  }
+	}
+	else {
+	  in_record=false;
+	  return (cw_type == cosblock::cw_eof) ? bfstream::eof : (cw_type == cosblock::cw_eod) ? craystream::eod : bfstream::error;
+	}
+	data=at(start);
+	switch (cw_type) {
+	  case cosblock::cw_bcw: {
+	    if (cw_pos < block_end) {
+		cw_type=-1;
+		in_record=false;
+		return bfstream::error;
+	    }
+	    in_record=true;
+// a piece with no data in it is passed over
+	    if (piece_len > 0) {
+		return piece_len;
+	    }
+	    break;
+	  }
+	  case cosblock::cw_eor: {
+	    ++num_read;
+	    in_record=false;
+	    end_of_record=true;
+	    return piece_len;
+	  }
+	  case cosblock::cw_eof: {
+	    in_record=false;
+	    return bfstream::eof;
+	  }
+	  case cosblock::cw_eod: {
+	    in_record=false;
+	    return craystream::eod;
+	  }
+	  default: {
+	    in_record=false;
+	    return bfstream::error;
+	  }
+	}
+    }
+  }
+  long long read(unsigned char *buffer,size_t buffer_length)
+  {
+    const unsigned char *data;
+    auto num_bytes=read(data);
+    if (num_bytes > 0) {
+	if (num_bytes > static_cast<long long>(buffer_length)) {
+	  num_bytes=buffer_length;
+	}
+	std::copy(data,data+num_bytes,buffer);
+    }
+    return num_bytes;
+  }
+  void rewind()
+  {
+    cw_pos=0;
+    num_read=0;
+    in_record=false;
+    next.cached=false;
+    if (stream.on) {
+// a stream can only be "rewound" to where it already is
+	if (stream.start > 0) {
+	  cw_type=-1;
+	  return;
+	}
+	stream.keep=0;
+	fill_window(cosblock::block_size);
+    }
+// a dataset must begin with a complete and valid first block
+    if (map_len < cosblock::block_size || !cosblock::is_first_block(at(0))) {
+	cw_type=-1;
+    }
+    else {
+	cw_type=cosblock::cw_bcw;
+    }
+  }
+
+// seek_file() and seek_record() position the stream so that the next read()
+// returns the first record of file "file_number" or the record
+// "record_number" (both count from 1) - they go straight there when an index
+// has been loaded and skip forward over the control words otherwise
+  bool seek_file(size_t file_number)
+  {
+    if (file_number == 0) {
+	return false;
+    }
+    if (index.map != nullptr) {
+	if (file_number > index.num_files) {
+	  return false;
+	}
+	auto entry=&index.map[cosblock::index_header_size+index.num_records*cosblock::index_record_size+(file_number-1)*cosblock::index_file_size];
+	return set_position(cosblock::unpack(entry,8),cosblock::unpack(&entry[8],8));
+    }
+    rewind();
+    for (size_t n=1; n < file_number; ++n) {
+	long long status;
+	while ( (status=ignore()) >= 0);
+	if (status != bfstream::eof || peek() == craystream::eod) {
+	  return false;
+	}
+    }
+    return true;
+  }
+  bool seek_record(size_t record_number)
+  {
+    if (record_number == 0) {
+	return false;
+    }
+    if (index.map != nullptr) {
+	if (record_number > index.num_records) {
+	  return false;
+	}
+	auto entry=&index.map[cosblock::index_header_size+(record_number-1)*cosblock::index_record_size];
+	return set_position(cosblock::unpack(entry,8),record_number-1);
+    }
+    rewind();
+    long long status;
+    while ( (status=peek()) != craystream::eod && status != bfstream::error) {
+	if (status >= 0 && num_read == record_number-1) {
+	  return true;
+	}
+	ignore();
+    }
+    return false;
+  }
+// seek() goes back (or forward) to the offset of a control word that was
+// returned by tell(), with "records_before" as the number of records read
+  bool seek(size_t pos,size_t records_before = 0) { return set_position(pos,records_before); }
+// offset of the control word at which the next read() starts
+  size_t tell() const { return cw_pos; }
+
+private:
+  const unsigned char *at(size_t pos) const
+  {
+    return (stream.on) ? &stream.window[pos-stream.start] : &map[pos];
+  }
+// fill_window() reads a stream until the window reaches "end", or the stream
+// ends - the blocks before the one at "stream.keep" are dropped first, once
+// there are enough of them to be worth moving the rest of the window
+  bool fill_window(size_t end)
+  {
+    if (!stream.on || end <= map_len) {
+	return (end <= map_len);
+    }
+    auto keep=stream.keep/cosblock::block_size*cosblock::block_size;
+    if (keep-stream.start >= Stream::chunk_size) {
+	std::copy(&stream.window[keep-stream.start],&stream.window[map_len-stream.start],stream.window.get());
+	stream.start=keep;
+    }
+    while (map_len < end && !stream.at_end) {
+	auto len=map_len-stream.start;
+	if (len+Stream::chunk_size > stream.window_len) {
+	  auto new_len=std::max(len+Stream::chunk_size,stream.window_len*2);
+	  std::unique_ptr<unsigned char[]> new_window(new unsigned char[new_len]);
+	  std::copy(stream.window.get(),stream.window.get()+len,new_window.get());
+	  stream.window.swap(new_window);
+	  stream.window_len=new_len;
+	}
+	auto n=read_source(&stream.window[len],Stream::chunk_size);
+	if (n <= 0) {
+	  stream.at_end=true;
+	}
+	else {
+	  map_len+=n;
+	}
+    }
+    return (end <= map_len);
+  }
+// is_compressed() looks for the magic number of a compressed dataset at the
+// start of a regular file
+  bool is_compressed() const
+  {
+    unsigned char magic[4];
+    if (pread(fd,magic,4,0) != 4) {
+	return false;
+    }
+    if (magic[0] == 0x1f && magic[1] == 0x8b) {
+	return true;
+    }
+#ifdef HAVE_ZSTD
+    if (cosblock::unpack(magic,4) == 0x28b52ffd) {
+	return true;
+    }
+#endif
+    return false;
+  }
+// open_source() reads the first chunk of a stream and sets up its decompression
+// from the magic number that the chunk starts with
+  bool open_source()
+  {
+    stream.on=true;
+    stream.in.reset(new unsigned char[Stream::chunk_size]);
+    fill_input();
+    if (stream.in_len >= 2 && stream.in[0] == 0x1f && stream.in[1] == 0x8b) {
+	stream.zs.reset(new z_stream());
+	if (inflateInit2(stream.zs.get(),15+16) != Z_OK) {
+	  stream.zs.reset();
+	  return false;
+	}
+	stream.format=Stream::gzip;
+    }
+#ifdef HAVE_ZSTD
+    else if (stream.in_len >= 4 && cosblock::unpack(stream.in.get(),4) == 0x28b52ffd) {
+	if ( (stream.zds=ZSTD_createDStream()) == nullptr) {
+	  return false;
+	}
+	ZSTD_initDStream(stream.zds);
+	stream.format=Stream::zstd;
+    }
+#endif
+    return true;
+  }
+  void close_source()
+  {
+    if (stream.zs != nullptr) {
+	inflateEnd(stream.zs.get());
+	stream.zs.reset();
+    }
+#ifdef HAVE_ZSTD
+    if (stream.zds != nullptr) {
+	ZSTD_freeDStream(stream.zds);
+	stream.zds=nullptr;
+    }
+#endif
+  }
+  void fill_input()
+  {
+    stream.in_pos=stream.in_len=0;
+    while (1) {
+	auto n=::read(fd,stream.in.get(),Stream::chunk_size);
+	if (n < 0 && errno == EINTR) {
+	  continue;
+	}
+	if (n <= 0) {
+	  stream.in_end=true;
+	}
+	else {
+	  stream.in_len=n;
+	}
+	return;
+    }
+  }
+// read_source() returns up to "length" bytes of the dataset, decompressed if it
+// needs to be, and 0 at the end of the stream or after an error - a dataset
+// that is cut short then fails for want of an EOD; a compressed dataset can be
+// several gzip members (or zstd frames), one after the other
+  long long read_source(unsigned char *buffer,size_t length)
+  {
+    while (1) {
+	if (stream.in_pos == stream.in_len) {
+	  if (stream.in_end) {
+	    return 0;
+	  }
+	  fill_input();
+	  continue;
+	}
+	auto in=&stream.in[stream.in_pos];
+	auto in_len=stream.in_len-stream.in_pos;
+	switch (stream.format) {
+	  case Stream::gzip: {
+	    auto zs=stream.zs.get();
+	    zs->next_in=in;
+	    zs->avail_in=in_len;
+	    zs->next_out=buffer;
+	    zs->avail_out=length;
+	    auto status=inflate(zs,Z_NO_FLUSH);
+	    stream.in_pos+=in_len-zs->avail_in;
+	    if (status == Z_STREAM_END) {
+		inflateReset(zs);
+	    }
+	    else if (status != Z_OK && status != Z_BUF_ERROR) {
+		stream.in_end=true;
+		stream.in_pos=stream.in_len;
+		return 0;
+	    }
+	    if (zs->avail_out < length) {
+		return length-zs->avail_out;
+	    }
+	    break;
+	  }
+#ifdef HAVE_ZSTD
+	  case Stream::zstd: {
+	    ZSTD_inBuffer zin={in,in_len,0};
+	    ZSTD_outBuffer zout={buffer,length,0};
+	    auto status=ZSTD_decompressStream(stream.zds,&zout,&zin);
+	    stream.in_pos+=zin.pos;
+	    if (ZSTD_isError(status)) {
+		stream.in_end=true;
+		stream.in_pos=stream.in_len;
+		return 0;
+	    }
+	    if (zout.pos > 0) {
+		return zout.pos;
+	    }
+	    break;
+	  }
+#endif
+	  default: {
+	    auto n=std::min(in_len,length);
+	    std::copy(in,in+n,buffer);
+	    stream.in_pos+=n;
+	    return n;
+	  }
+	}
+    }
+  }
+  long long next_record(const unsigned char **data)
+  {
+    switch (cw_type) {
+	case cosblock::cw_bcw:
+	case cosblock::cw_eor:
+	case cosblock::cw_eof: {
+	  break;
+	}
+	case cosblock::cw_eod: {
+	  return craystream::eod;
+	}
+	default: {
+	  return bfstream::error;
+	}
+    }
+    size_t first=0;
+    long long len=0;
+    auto have_first=false,stitched=false;
+    while (1) {
+	auto cw=cosblock::word(at(cw_pos));
+	auto block_end=(cw_pos/cosblock::block_size+1)*cosblock::block_size;
+	auto start=cw_pos+cosblock::word_size;
+// the block of the first piece of a record is kept until the piece has been
+// copied
+	if (!have_first || stitched) {
+	  stream.keep=cw_pos;
+	}
+	fill_window(block_end+cosblock::block_size);
+	cw_pos+=(cosblock::forward_index(cw)+1)*cosblock::word_size;
+	if (cw_pos > block_end) {
+	  cw_type=-1;
+	  return bfstream::error;
+	}
+	if (cw_pos == block_end && cw_pos+cosblock::block_size > map_len) {
+// the dataset ends without an EOD
+	  cw_type=-1;
+	  return bfstream::error;
+	}
+	auto ncw=cosblock::word(at(cw_pos));
+	cw_type=cosblock::type(ncw);
+	long long piece_len=cw_pos-start;
+	if (cw_pos < block_end) {
+// the unused bits in the next control word apply to the data that precede it,
+// which can be the end of the previous block when this piece is empty
+	  piece_len-=cosblock::unused_bits(ncw)/8;
+	}
+	else if (cw_type != cosblock::cw_bcw) {
+	  switch (cw_type) {
+	    case cosblock::cw_eof: {
+		return bfstream::eof;
+	    }
+	    case cosblock::cw_eod: {
+		return craystream::eod;
+	    }
+	    default: {
+		return bfstream::error;
+	    }
+	  }
+	}
+	if (data != nullptr && piece_len > 0) {
+	  if (!have_first) {
+	    first=start;
+	    have_first=true;
+	  }
+	  else {
+// the record crosses a block, so its pieces have to be stitched together
+	    if (!stitched) {
+		grow_record_buffer(len);
+		std::copy(at(first),at(first)+len,rec_buf.get());
+		stitched=true;
+	    }
+	    grow_record_buffer(len+piece_len);
+	    std::copy(at(start),at(start)+piece_len,&rec_buf[len]);
+	  }
+	}
+	len+=piece_len;
+	switch (cw_type) {
+	  case cosblock::cw_bcw: {
+	    if (cw_pos < block_end) {
+		cw_type=-1;
+		return bfstream::error;
+	    }
+	    break;
+	  }
+	  case cosblock::cw_eor: {
+	    ++num_read;
+	    if (data != nullptr) {
+		*data=(stitched) ? rec_buf.get() : (have_first) ? at(first) : nullptr;
+	    }
+	    return len;
+	  }
+	  case cosblock::cw_eof: {
+	    return bfstream::eof;
+	  }
+	  case cosblock::cw_eod: {
+	    return craystream::eod;
+	  }
+	  default: {
+	    return bfstream::error;
+	  }
+	}
+    }
+  }
+  bool set_position(size_t pos,size_t records_before)
+  {
+    if (stream.on || pos+cosblock::word_size > map_len) {
+	return false;
+    }
+    cw_pos=pos;
+    cw_type=cosblock::type(cosblock::word(at(cw_pos)));
+    num_read=records_before;
+    in_record=false;
+    next.cached=false;
+    return true;
+  }
+  long long take_next(const unsigned char **data)
+  {
+    cw_pos=next.cw_pos;
+    cw_type=next.cw_type;
+    num_read=next.num_read;
+    next.cached=false;
+    if (data != nullptr) {
+	*data=next.data;
+    }
+    return next.status;
+  }
+  void unload_index()
+  {
+    if (index.map != nullptr) {
+	munmap(const_cast<unsigned char *>(index.map),index.map_len);
+	index.map=nullptr;
+    }
+  }
+  void grow_record_buffer(size_t length)
+  {
+    if (length > rec_buf_len) {
+	auto new_len=std::max(length,rec_buf_len*2);
+	std::unique_ptr<unsigned char[]> new_buf(new unsigned char[new_len]);
+	if (rec_buf_len > 0) {
+	  std::copy(rec_buf.get(),rec_buf.get()+rec_buf_len,new_buf.get());
+	}
+	rec_buf.swap(new_buf);
+	rec_buf_len=new_len;
+    }
+  }
+
+  std::string file_name;
+  int fd;
+  const unsigned char *map;
+  size_t map_len;
+  struct timespec mtime;
+  size_t cw_pos;
+  short cw_type;
+  size_t num_read;
+  bool in_record;
+  std::unique_ptr<unsigned char[]> rec_buf;
+  size_t rec_buf_len;
+  struct NextRecord {
+    NextRecord() : cached(false),status(0),data(nullptr),cw_pos(0),cw_type(0),num_read(0) {}
+
+    bool cached;
+    long long status;
+    const unsigned char *data;
+    size_t cw_pos;
+    short cw_type;
+    size_t num_read;
+  } next;
+  struct Index {
+    Index() : map(nullptr),map_len(0),num_records(0),num_files(0) {}
+
+    const unsigned char *map;
+    size_t map_len,num_records,num_files;
+  } index;
+  struct Stream {
+#ifdef HAVE_ZSTD
+    Stream() : on(false),at_end(false),in_end(false),window(nullptr),window_len(0),start(0),keep(0),in(nullptr),in_len(0),in_pos(0),format(plain),zs(nullptr),zds(nullptr) {}
+#else
+    Stream() : on(false),at_end(false),in_end(false),window(nullptr),window_len(0),start(0),keep(0),in(nullptr),in_len(0),in_pos(0),format(plain),zs(nullptr) {}
+#endif
+
+    static const size_t chunk_size=262144;
+    enum Format {plain,gzip,zstd};
+    bool on,at_end,in_end;
+    std::unique_ptr<unsigned char[]> window;
+    size_t window_len,start,keep;
+    std::unique_ptr<unsigned char[]> in;
+    size_t in_len,in_pos;
+    Format format;
+    std::unique_ptr<z_stream> zs;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zds;
+#endif
+  } stream;
+};
+
+// omcstream writes a COS-blocked dataset in the same layout as ocstream. A
+// record can be written whole with write(), or in parts with write_part()
+// followed by a write() of the last part - the data only pass through the
+// block buffer, so there is no limit on the length of a record.
+//
+// The blocks are built in place in a large, page-aligned buffer that goes to
+// the file in one write() when it fills. A stream that is opened with
+// "bypass_cache" writes a regular file with O_DIRECT, or, where the file
+// system does not allow it, drops each buffer of the file from the page cache
+// once it has been written.
+class omcstream
+{
+public:
+  omcstream() : fd(-1),buf(nullptr),blk(nullptr),buf_len(0),file_off(0),dropped_off(0),pos(0),cw_off(0),blocks_full(0),blocks_back(0),rec_len(0),num_written(0),direct(false),drop_cache(false),wrote_eof(false),write_failed(false) {}
+  omcstream(std::string filename,bool bypass_cache = false) : omcstream() { open(filename,bypass_cache); }
+  omcstream(const omcstream& source) = delete;
+  ~omcstream() { close(); free(buf); }
+  omcstream& operator=(const omcstream& source) = delete;
+// close() writes out what is left in the buffer, and returns false if that or
+// any earlier write failed
+  bool close()
+  {
+    if (!is_open()) {
+	return true;
+    }
+    if (!wrote_eof) {
+	write_eof();
+    }
+    put_control_word(cosblock::cw_eod);
+    end_block();
+    flush();
+    if (drop_cache && file_off > dropped_off) {
+	drop_cached_pages(fd,dropped_off,file_off-dropped_off);
+    }
+    if (fd != STDOUT_FILENO && ::close(fd) != 0) {
+	write_failed=true;
+    }
+    fd=-1;
+    return !write_failed;
+  }
+  bool is_open() const { return (fd >= 0); }
+  size_t number_written() const { return num_written; }
+// the number of blocks that have been started, and the room for data that is
+// left in the current block
+  size_t block_count() const { return blocks_full+1; }
+  size_t block_space() const { return cosblock::block_size-pos; }
+  bool open(std::string filename,bool bypass_cache = false)
+  {
+// opening a stream while another is open is a fatal error
+    if (is_open()) {
+	std::cerr << "Error: an open stream already exists" << std::endl;
+	exit(1);
+    }
+// "-" is standard output
+    if (filename == "-") {
+	fd=STDOUT_FILENO;
+    }
+    else if ( (fd=::open(filename.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0666)) < 0) {
+	return false;
+    }
+    if (buf == nullptr && posix_memalign(reinterpret_cast<void **>(&buf),cosblock::block_size,buffer_size) != 0) {
+	buf=nullptr;
+	if (fd != STDOUT_FILENO) {
+	  ::close(fd);
+	}
+	fd=-1;
+	return false;
+    }
+    direct=drop_cache=false;
+    if (bypass_cache) {
+	set_cache_bypass();
+    }
+    blk=buf;
+    buf_len=0;
+    file_off=dropped_off=0;
+    std::fill(blk,blk+cosblock::block_size,0);
+    pos=cosblock::word_size;
+    cw_off=0;
+    blocks_full=blocks_back=0;
+    rec_len=0;
+    num_written=0;
+    wrote_eof=false;
+    write_failed=false;
+    return true;
+  }
+// write_part() adds data to the record that is being written
+  int write_part(const unsigned char *buffer,size_t num_bytes)
+  {
+    auto n=num_bytes;
+    while (n > 0) {
+	if (pos == cosblock::block_size) {
+	  next_block();
+	}
+	auto len=std::min(n,cosblock::block_size-pos);
+	std::copy(buffer,buffer+len,&blk[pos]);
+	buffer+=len;
+	pos+=len;
+	n-=len;
+    }
+    rec_len+=num_bytes;
+    return (write_failed) ? static_cast<int>(bfstream::error) : static_cast<int>(num_bytes);
+  }
+// write() adds the last (or only) part of a record and ends the record
+  int write(const unsigned char *buffer,size_t num_bytes)
+  {
+    write_part(buffer,num_bytes);
+    put_control_word(cosblock::cw_eor,((cosblock::word_size-rec_len % cosblock::word_size) % cosblock::word_size)*8);
+    rec_len=0;
+    ++num_written;
+    wrote_eof=false;
+    return (write_failed) ? static_cast<int>(bfstream::error) : static_cast<int>(num_bytes);
+  }
+  void write_eof()
+  {
+    put_control_word(cosblock::cw_eof);
+    wrote_eof=true;
+  }
+
+private:
+  static const size_t buffer_size=1024*cosblock::block_size;
+
+// set_cache_bypass() turns on O_DIRECT for a regular file - a file system that
+// refuses it falls back to dropping the written pages, and a pipe is left alone
+  void set_cache_bypass()
+  {
+    struct stat stat_buf;
+    if (fstat(fd,&stat_buf) != 0 || !S_ISREG(stat_buf.st_mode)) {
+	return;
+    }
+#ifdef O_DIRECT
+    auto flags=fcntl(fd,F_GETFL);
+    if (flags >= 0 && fcntl(fd,F_SETFL,flags | O_DIRECT) == 0) {
+	direct=true;
+	return;
+    }
+#endif
+    drop_cache=true;
+  }
+// end_block() closes the current block and starts the next one in the buffer,
+// writing out the buffer first if the block was the last one that fits
+  void end_block()
+  {
+    buf_len+=cosblock::block_size;
+    if (buf_len == buffer_size) {
+	flush();
+    }
+    blk=&buf[buf_len];
+    std::fill(blk,blk+cosblock::block_size,0);
+  }
+  void flush()
+  {
+    size_t n=0;
+    while (n < buf_len) {
+	auto num_bytes=::write(fd,&buf[n],buf_len-n);
+	if (num_bytes < 0 && errno == EINTR) {
+	  continue;
+	}
+#ifdef O_DIRECT
+// some file systems accept O_DIRECT when the file is opened, but not when it
+// is written to
+	if (num_bytes < 0 && errno == EINVAL && direct) {
+	  fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) & ~O_DIRECT);
+	  direct=false;
+	  drop_cache=true;
+	  continue;
+	}
+#endif
+	if (num_bytes <= 0) {
+	  write_failed=true;
+	  break;
+	}
+	n+=num_bytes;
+    }
+    file_off+=buf_len;
+    buf_len=0;
+// the pages of the previous buffer are dropped while this one is still on its
+// way to the disk
+    if (drop_cache) {
+#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(fd,file_off-n,n,SYNC_FILE_RANGE_WRITE);
+#endif
+	if (file_off-n > dropped_off) {
+	  drop_cached_pages(fd,dropped_off,file_off-n-dropped_off);
+	  dropped_off=file_off-n;
+	}
+    }
+  }
+  void set_forward_index(size_t next_off)
+  {
+    auto cw=cosblock::word(&blk[cw_off]);
+    cw=(cw & ~0x1ffULL) | ((next_off-cw_off)/cosblock::word_size-1);
+    cosblock::pack(&blk[cw_off],cw,cosblock::word_size);
+  }
+  void next_block()
+  {
+    set_forward_index(cosblock::block_size);
+    end_block();
+    ++blocks_full;
+    ++blocks_back;
+    cosblock::pack(blk,static_cast<unsigned long long>(blocks_full & 0xffffff) << 9,cosblock::word_size);
+    cw_off=0;
+    pos=cosblock::word_size;
+  }
+// put_control_word() starts the next control word on a word boundary, in a new
+// block if the current one is full - an EOR carries the unused bits of its
+// record and the index of the block of the previous EOR
+  void put_control_word(short type,size_t unused_bits = 0)
+  {
+    pos=(pos+cosblock::word_size-1)/cosblock::word_size*cosblock::word_size;
+    if (pos == cosblock::block_size) {
+	next_block();
+    }
+    set_forward_index(pos);
+    unsigned long long cw=static_cast<unsigned long long>(type) << 60;
+    if (type == cosblock::cw_eor) {
+	cw|=(static_cast<unsigned long long>(unused_bits) << 54) | (static_cast<unsigned long long>(blocks_full & 0xfffff) << 24) | (static_cast<unsigned long long>(blocks_back & 0x7fff) << 9);
+	blocks_back=0;
+    }
+    else if (type == cosblock::cw_eof) {
+	cw|=static_cast<unsigned long long>(blocks_full & 0xfffff) << 24;
+    }
+    cosblock::pack(&blk[pos],cw,cosblock::word_size);
+    cw_off=pos;
+    pos+=cosblock::word_size;
+  }
+
+  int fd;
+  unsigned char *buf,*blk;
+  size_t buf_len,file_off,dropped_off,pos,cw_off,blocks_full,blocks_back,rec_len,num_written;
+  bool direct,drop_cache,wrote_eof,write_failed;
+};
+
+#endif
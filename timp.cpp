@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
 #include <math.h>
@@ -2299,24 +2300,37 @@ private:
   bool at_eod;
 };
 
+// ocstream builds its blocks one at a time in file_buf, and gathers the
+// finished blocks in a large output buffer that goes to disk in one write when
+// it fills - with setDropCache(true), the pages of each buffer are dropped
+// from the page cache once they are on disk. Since the last buffer is only
+// written by close(), writeFailed() tells afterward whether any write failed.
 class ocstream : public obfstream, virtual public craystream
 {
 public:
-  ocstream() {}
-  ocstream(const char *filename) { open(filename); }
-  virtual ~ocstream() { if (isOpen()) close(); }
+  ocstream() { oc.out_buf=NULL; oc.drop_cache=oc.write_failed=false; }
+  ocstream(const char *filename) { oc.out_buf=NULL; oc.drop_cache=oc.write_failed=false; open(filename); }
+  virtual ~ocstream() { if (isOpen()) close(); if (oc.out_buf != NULL) delete[] oc.out_buf; }
   void close();
   bool open(const char *filename);
   void rewind();
+  void setDropCache(bool drop_cache) { oc.drop_cache=drop_cache; }
   int write(const unsigned char *buffer,size_t num_bytes);
   void writeEOF();
+  bool writeFailed() const { return oc.write_failed; }
 
 private:
+  int flushToDisk();
   int writeToDisk();
 
+  static const size_t out_buf_size;
   struct {
     size_t block_space,blocks_full,blocks_back;
     bool wrote_eof;
+    unsigned char *out_buf;
+    size_t out_buf_len;
+    off_t out_off;
+    bool drop_cache,write_failed;
   } oc;
 };
 
@@ -2858,13 +2872,40 @@ void icstream::rewind()
   readFromDisk();
 }
 
+const size_t ocstream::out_buf_size=1024*cray_block_size;
+
+int ocstream::flushToDisk()
+{
+  size_t num_out;
+
+  if (oc.out_buf_len == 0)
+    return 0;
+  num_out=fwrite(oc.out_buf,1,oc.out_buf_len,fp);
+  if (num_out != oc.out_buf_len) {
+    oc.write_failed=true;
+    return -1;
+  }
+  if (oc.drop_cache) {
+    fflush(fp);
+#ifdef POSIX_FADV_DONTNEED
+    fdatasync(fileno(fp));
+    posix_fadvise(fileno(fp),oc.out_off,num_out,POSIX_FADV_DONTNEED);
+#endif
+  }
+  oc.out_off+=num_out;
+  oc.out_buf_len=0;
+
+  return num_out;
+}
+
 inline int ocstream::writeToDisk()
 {
-  size_t n,num_out;
+  size_t n,num_out=file_buf_len;
 
-  num_out=fwrite(file_buf,1,file_buf_len,fp);
-  if (num_out != file_buf_len)
+  if (oc.out_buf_len+file_buf_len > out_buf_size && flushToDisk() == error)
     return -1;
+  memcpy(&oc.out_buf[oc.out_buf_len],file_buf,file_buf_len);
+  oc.out_buf_len+=file_buf_len;
   file_buf_pos=0;
   for (n=0; n < cray_word_size; n++)
     file_buf[n]=0;
@@ -2900,8 +2941,10 @@ void ocstream::close()
   for (n=file_buf_pos+8; n < file_buf_len; n++)
     file_buf[n]=0;
   writeToDisk();
+  flushToDisk();
 
-  fclose(fp);
+  if (fclose(fp) != 0)
+    oc.write_failed=true;
   fp=NULL;
   if (file != NULL) {
     delete[] file;
@@ -2916,6 +2959,13 @@ bool ocstream::open(const char *filename)
   if (!obfstream::open(filename))
     return false;
 
+// the output buffer replaces the stdio buffer
+  setvbuf(fp,NULL,_IONBF,0);
+  if (oc.out_buf == NULL)
+    oc.out_buf=new unsigned char[out_buf_size];
+  oc.out_buf_len=0;
+  oc.out_off=0;
+  oc.write_failed=false;
   file_buf_pos=0;
   for (n=0; n < 8; n++)
     file_buf[n]=0;
@@ -3448,6 +3498,7 @@ struct Args {
   bool dpcconv;
   bool ebcconv;
   bool rewind;
+  bool nocache;
   String device_name;
 } args;
 
@@ -3465,6 +3516,7 @@ void parseArgs(int argc,char **argv)
   args.dpcconv=false;
   args.ebcconv=false;
   args.rewind=true;
+  args.nocache=false;
   args.num_files=0x7fffffff;
   args.num_blocks=0x7fffffff;
   args.num_errors=5;
@@ -3503,6 +3555,8 @@ void parseArgs(int argc,char **argv)
     }
     else if (sp.getPart(n) == "-norew")
 	args.rewind=false;
+    else if (sp.getPart(n) == "-nocache")
+	args.nocache=true;
     else if (sp.getPart(n) == "-numb") {
 	n++;
 	args.num_blocks=atoi(sp.getPart(n).toChar());
@@ -3536,6 +3590,7 @@ void read7trk()
 
   if (args.ofile.getLength() > 0) {
     if (args.block_type > 0) {
+	ocs.setDropCache(args.nocache);
 	if (!ocs.open(args.ofile.toChar()))
 	  error("unable to open output file "+args.ofile);
     }
@@ -3616,6 +3671,8 @@ void read7trk()
   }
   else {
     ocs.close();
+    if (ocs.writeFailed())
+	error("unable to write output file "+args.ofile);
     std::cout << "COS-blocked records written: " << ocs.getNumberWritten() << std::endl;
   }
 }
@@ -3637,6 +3694,7 @@ void read9trk()
     error(String("don't know which 9-track device to use"));
   if (args.ofile.getLength() > 0) {
     if (args.block_type > 0) {
+	ocs.setDropCache(args.nocache);
 	if (!ocs.open(args.ofile.toChar()))
 	  error("unable to open output file "+args.ofile);
     }
@@ -3720,6 +3778,8 @@ void read9trk()
   }
   else {
     ocs.close();
+    if (ocs.writeFailed())
+	error("unable to write output file "+args.ofile);
     std::cout << "COS-blocked records written: " << ocs.getNumberWritten() << std::endl;
   }
 }
@@ -3755,6 +3815,8 @@ int main(int argc,char **argv)
     std::cerr << "-blocke[d] (none | binary | character)    specifies that the output file is a" << std::endl;
     std::cerr << "                                          stream of bytes, or a COS-blocked" << std::endl;
     std::cerr << "                                          binary or character dataset" << std::endl << std::endl;
+    std::cerr << "-nocache                                  drop the COS-blocked output file from" << std::endl;
+    std::cerr << "                                          the page cache as it is written" << std::endl << std::endl;
     std::cerr << "-norew                                    the tape will not rewind before the" << std::endl;
     std::cerr << "                                          program exits (default is to rewind)" << std::endl << std::endl;
     std::cerr << "-numb <num>                               read <num> blocks from tape and quit" << std::endl << std::endl;